@@ -0,0 +1,227 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "processx.h"
+
+/* Bounded output capture
+ *
+ * A capture buffer keeps a bounded part of an output stream, so its
+ * memory use only depends on the policy, and not on the size of the
+ * output:
+ *
+ * - tail: the last `size` bytes, in a ring. If `lines` is not negative,
+ *   then at most the last `lines` lines of these.
+ * - head_tail: the first `head` bytes, and the last `size` bytes, in a
+ *   ring.
+ * - drop: the last `size` bytes, but without a partial first line, so
+ *   the oldest lines are dropped whole when the ring is full. The last
+ *   line is kept even without a newline, it is the end of the output.
+ *
+ * We count all bytes and newlines, to report how much was elided.
+ */
+
+#define PROCESSX__CAPTURE_TAIL      1
+#define PROCESSX__CAPTURE_HEAD_TAIL 2
+#define PROCESSX__CAPTURE_DROP      3
+
+struct processx_capture_s {
+  int type;
+  int lines;			/* tail: number of lines, or -1 */
+  char *head;
+  size_t head_size, head_len;
+  char *ring;
+  size_t size, start, len;
+  double total_bytes, total_lines;
+};
+
+static void processx__capture_finalizer(SEXP ptr) {
+  processx_capture_t *capture = R_ExternalPtrAddr(ptr);
+  if (!capture) return;
+  free(capture->head);
+  free(capture->ring);
+  free(capture);
+  R_ClearExternalPtr(ptr);
+}
+
+SEXP processx_capture_create(SEXP type, SEXP size, SEXP head,
+			     SEXP lines) {
+  processx_capture_t *capture = calloc(1, sizeof(processx_capture_t));
+  SEXP result;
+
+  if (!capture) R_THROW_ERROR("Cannot allocate memory for output capture");
+  capture->type = INTEGER(type)[0];
+  capture->lines = INTEGER(lines)[0];
+  capture->size = (size_t) REAL(size)[0];
+  capture->head_size = capture->type == PROCESSX__CAPTURE_HEAD_TAIL ?
+    (size_t) REAL(head)[0] : 0;
+
+  if (capture->size > 0) capture->ring = malloc(capture->size);
+  if (capture->head_size > 0) capture->head = malloc(capture->head_size);
+  if ((capture->size > 0 && !capture->ring) ||
+      (capture->head_size > 0 && !capture->head)) {
+    free(capture->ring);
+    free(capture->head);
+    free(capture);
+    R_THROW_ERROR("Cannot allocate memory for output capture");
+  }
+
+  result = PROTECT(R_MakeExternalPtr(capture, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(result, processx__capture_finalizer, 1);
+  UNPROTECT(1);
+  return result;
+}
+
+static double processx__count_lines(const char *data, size_t n) {
+  double count = 0;
+  const char *end = data + n, *nl;
+  while (data < end && (nl = memchr(data, '\n', end - data))) {
+    count++;
+    data = nl + 1;
+  }
+  return count;
+}
+
+void processx__capture_push(processx_capture_t *capture, const char *data,
+			    size_t n) {
+  size_t end, first;
+
+  capture->total_bytes += n;
+  capture->total_lines += processx__count_lines(data, n);
+
+  if (capture->head_len < capture->head_size) {
+    size_t k = capture->head_size - capture->head_len;
+    if (k > n) k = n;
+    memcpy(capture->head + capture->head_len, data, k);
+    capture->head_len += k;
+    data += k;
+    n -= k;
+  }
+
+  if (n == 0 || capture->size == 0) return;
+
+  if (n >= capture->size) {
+    memcpy(capture->ring, data + n - capture->size, capture->size);
+    capture->start = 0;
+    capture->len = capture->size;
+    return;
+  }
+
+  /* If the ring is full, then `end` is `start`, and we overwrite the
+     oldest bytes */
+  end = (capture->start + capture->len) % capture->size;
+  first = capture->size - end;
+  if (first > n) first = n;
+  memcpy(capture->ring + end, data, first);
+  memcpy(capture->ring, data + first, n - first);
+  capture->len += n;
+  if (capture->len > capture->size) {
+    capture->start = (capture->start + capture->len - capture->size) %
+      capture->size;
+    capture->len = capture->size;
+  }
+}
+
+/* Length of `s`, without an incomplete UTF-8 character at the end */
+
+static size_t processx__utf8_complete(const char *s, size_t n) {
+  size_t i = n, need;
+  unsigned char c;
+  while (i > 0 && n - i < 3 && (s[i - 1] & 0xC0) == 0x80) i--;
+  if (i == 0) return n;
+  c = (unsigned char) s[i - 1];
+  need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+  return n - (i - 1) < need ? i - 1 : n;
+}
+
+SEXP processx__capture_string(processx_capture_t *capture) {
+  char marker[64] = "";
+  size_t marker_len = 0, head_len = capture->head_len, tail_len;
+  size_t first;
+  char *buf, *tail;
+  double elided;
+  SEXP result;
+
+  /* Linearize the ring, after the head and room for the marker */
+  buf = R_alloc(head_len + sizeof(marker) + capture->len + 1, 1);
+  memcpy(buf, capture->head, head_len);
+  tail = buf + head_len + sizeof(marker);
+  tail_len = capture->len;
+  if (tail_len > 0) {
+    first = capture->size - capture->start;
+    if (first > tail_len) first = tail_len;
+    memcpy(tail, capture->ring + capture->start, first);
+    memcpy(tail + first, capture->ring, tail_len - first);
+  }
+
+  if (capture->total_bytes > head_len + tail_len) {
+    /* Some bytes were overwritten, so the ring starts in the middle of
+       a character, and of a line */
+    while (tail_len > 0 && (*tail & 0xC0) == 0x80) {
+      tail++;
+      tail_len--;
+    }
+    if (capture->type == PROCESSX__CAPTURE_DROP) {
+      char *nl = memchr(tail, '\n', tail_len);
+      size_t skip = nl ? (size_t) (nl + 1 - tail) : tail_len;
+      tail += skip;
+      tail_len -= skip;
+    }
+    if (capture->type == PROCESSX__CAPTURE_HEAD_TAIL) {
+      head_len = processx__utf8_complete(buf, head_len);
+    }
+  }
+
+  if (capture->type == PROCESSX__CAPTURE_TAIL && capture->lines >= 0) {
+    size_t i = tail_len, start = capture->lines == 0 ? tail_len : 0;
+    int count = 0;
+    if (capture->lines > 0 && i > 0 && tail[i - 1] == '\n') i--;
+    for (; capture->lines > 0 && i > 0; i--) {
+      if (tail[i - 1] == '\n' && ++count == capture->lines) {
+	start = i;
+	break;
+      }
+    }
+    tail += start;
+    tail_len -= start;
+  }
+
+  elided = capture->total_bytes - head_len - tail_len;
+  if (capture->type == PROCESSX__CAPTURE_HEAD_TAIL && elided > 0) {
+    int nl = head_len > 0 && buf[head_len - 1] != '\n';
+    marker_len = snprintf(marker, sizeof(marker),
+			  "%s[... %.0f bytes elided ...]\n",
+			  nl ? "\n" : "", elided);
+  }
+
+  /* Move the marker and the tail right after the head */
+  memcpy(buf + head_len, marker, marker_len);
+  memmove(buf + head_len + marker_len, tail, tail_len);
+  if (head_len + marker_len + tail_len > INT_MAX) {
+    R_THROW_ERROR("Output is too long for a single string");
+  }
+
+  result = PROTECT(ScalarString(mkCharLenCE(
+    buf, (int) (head_len + marker_len + tail_len), CE_UTF8)));
+  setAttrib(result, install("elided_bytes"), ScalarReal(elided));
+  setAttrib(result, install("elided_lines"), ScalarReal(
+    capture->total_lines -
+    processx__count_lines(buf, head_len) -
+    processx__count_lines(buf + head_len + marker_len, tail_len)));
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_capture_push(SEXP ptr, SEXP data) {
+  processx_capture_t *capture = R_ExternalPtrAddr(ptr);
+  if (!capture) R_THROW_ERROR("Invalid output capture object");
+  processx__capture_push(capture, (const char*) RAW(data), XLENGTH(data));
+  return R_NilValue;
+}
+
+SEXP processx_capture_read(SEXP ptr) {
+  processx_capture_t *capture = R_ExternalPtrAddr(ptr);
+  if (!capture) R_THROW_ERROR("Invalid output capture object");
+  return processx__capture_string(capture);
+}
@@ -24,26 +24,58 @@ static const R_CallMethodDef callMethods[]  = {
   { "processx_kill",               (DL_FUNC) &processx_kill,               3 },
   { "processx_get_pid",            (DL_FUNC) &processx_get_pid,            1 },
   { "processx_create_time",        (DL_FUNC) &processx_create_time,        1 },
-  { "processx_poll",               (DL_FUNC) &processx_poll,               3 },
+  { "processx_poll",               (DL_FUNC) &processx_poll,               5 },
+  { "processx_run",                (DL_FUNC) &processx_run,                6 },
+  { "processx_capture_create",     (DL_FUNC) &processx_capture_create,     4 },
+  { "processx_capture_push",       (DL_FUNC) &processx_capture_push,       2 },
+  { "processx_capture_read",       (DL_FUNC) &processx_capture_read,       1 },
+  { "processx_poller_create",      (DL_FUNC) &processx_poller_create,      1 },
+  { "processx_poller_add",         (DL_FUNC) &processx_poller_add,         4 },
+  { "processx_poller_remove",      (DL_FUNC) &processx_poller_remove,      2 },
+  { "processx_poller_poll",        (DL_FUNC) &processx_poller_poll,        2 },
+  { "processx_poller_info",        (DL_FUNC) &processx_poller_info,        1 },
+  { "processx_poller_attach",      (DL_FUNC) &processx_poller_attach,      2 },
+  { "processx_poller_detach",      (DL_FUNC) &processx_poller_detach,      1 },
+  { "processx_timer_create",       (DL_FUNC) &processx_timer_create,       2 },
+  { "processx_timer_status",       (DL_FUNC) &processx_timer_status,       1 },
   { "processx__process_exists",    (DL_FUNC) &processx__process_exists,    1 },
   { "processx__unload_cleanup",    (DL_FUNC) &processx__unload_cleanup,    0 },
   { "processx_is_named_pipe_open", (DL_FUNC) &processx_is_named_pipe_open, 1 },
   { "processx_close_named_pipe",   (DL_FUNC) &processx_close_named_pipe,   1 },
   { "processx_create_named_pipe",  (DL_FUNC) &processx_create_named_pipe,  2 },
   { "processx_write_named_pipe",   (DL_FUNC) &processx_write_named_pipe,   2 },
+  { "processx_connection_tee",     (DL_FUNC) &processx_connection_tee,     2 },
+  { "processx_tee_status",         (DL_FUNC) &processx_tee_status,         1 },
+  { "processx_tee_wait",           (DL_FUNC) &processx_tee_wait,           2 },
+  { "processx_connection_feed",    (DL_FUNC) &processx_connection_feed,    2 },
+  { "processx_feed_status",        (DL_FUNC) &processx_feed_status,        1 },
+  { "processx_connection_start_reader", (DL_FUNC) &processx_connection_start_reader, 2 },
+  { "processx_reader_status",      (DL_FUNC) &processx_reader_status,      1 },
   { "processx__proc_start_time",   (DL_FUNC) &processx__proc_start_time,   1 },
+  { "processx__pidfd_supported",   (DL_FUNC) &processx__pidfd_supported,   0 },
+  { "processx__pidfd_connection",  (DL_FUNC) &processx__pidfd_connection,  2 },
   { "processx__set_boot_time",     (DL_FUNC) &processx__set_boot_time,     1 },
 
   { "processx_connection_create",     (DL_FUNC) &processx_connection_create,     2 },
-  { "processx_connection_read_chars", (DL_FUNC) &processx_connection_read_chars, 2 },
+  { "processx_connection_read_chars", (DL_FUNC) &processx_connection_read_chars, 3 },
   { "processx_connection_read_lines", (DL_FUNC) &processx_connection_read_lines, 2 },
+  { "processx_connection_read_records",
+    (DL_FUNC) &processx_connection_read_records, 3 },
+  { "processx_connection_read_frames",
+    (DL_FUNC) &processx_connection_read_frames,  5 },
+  { "processx_connection_read_all",   (DL_FUNC) &processx_connection_read_all,   2 },
   { "processx_connection_write_bytes",(DL_FUNC) &processx_connection_write_bytes,2 },
+  { "processx_connection_flush",      (DL_FUNC) &processx_connection_flush,      2 },
+  { "processx_connection_write_pending",
+    (DL_FUNC) &processx_connection_write_pending, 1 },
   { "processx_connection_is_eof",     (DL_FUNC) &processx_connection_is_eof,     1 },
   { "processx_connection_close",      (DL_FUNC) &processx_connection_close,      1 },
   { "processx_connection_poll",       (DL_FUNC) &processx_connection_poll,       2 },
 
   { "processx_connection_create_pipepair",
     (DL_FUNC) processx_connection_create_pipepair, 2 },
+  { "processx_connection_create_os_pipe",
+    (DL_FUNC) &processx_connection_create_os_pipe, 1 },
   { "processx_connection_create_fd",  (DL_FUNC) &processx_connection_create_fd,  3 },
   { "processx_connection_create_file",
     (DL_FUNC) &processx_connection_create_file,    3 },
@@ -1,20 +1,157 @@
 
+#include <math.h>
+#include <limits.h>
+
 #include "processx.h"
 
-SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms) {
+/* Bytes that can be read from a ready connection, NA for everything
+   else. Capped, because we return integers. */
+
+static int processx__poll_bytes(int type, processx_pollable_t *pollable) {
+  double bytes;
+  if ((type != 1 && type != 2) || pollable->event != PXREADY ||
+      !pollable->object) {
+    return NA_INTEGER;
+  }
+  bytes = processx_c_connection_bytes_available(pollable->object);
+  return bytes > INT_MAX ? INT_MAX : (int) bytes;
+}
+
+/* In sparse mode the result is an integer matrix, with one row for each
+   ready pollable, and columns: index (1-based), stream (1: output or
+   connection or curl, 2: error, 3: poll connection) and the event code.
+   Silent, timed out and nopipe pollables are not included. If `bytes`
+   is true, then there is a fourth column, with the number of bytes to
+   read. */
+
+static SEXP processx__poll_sparse(SEXP types, int num_total,
+				  processx_pollable_t *pollables, int bytes) {
+  int i, j, k, s, nstreams, nready = 0;
+  int ncol = bytes ? 4 : 3;
+  int *cres;
+  SEXP result, dimnames, colnames;
+
+  for (i = 0, j = 0; i < num_total; i++) {
+    nstreams = INTEGER(types)[i] == 1 ? 3 : 1;
+    for (s = 0; s < nstreams; s++, j++) {
+      int ev = pollables[j].event;
+      if (ev == PXREADY || ev == PXCLOSED || ev == PXEVENT) nready++;
+    }
+  }
+
+  result = PROTECT(allocMatrix(INTSXP, nready, ncol));
+  cres = INTEGER(result);
+  for (i = 0, j = 0, k = 0; i < num_total; i++) {
+    nstreams = INTEGER(types)[i] == 1 ? 3 : 1;
+    for (s = 0; s < nstreams; s++, j++) {
+      int ev = pollables[j].event;
+      if (ev == PXREADY || ev == PXCLOSED || ev == PXEVENT) {
+	cres[k] = i + 1;
+	cres[k + nready] = s + 1;
+	cres[k + 2 * nready] = ev;
+	if (bytes) {
+	  cres[k + 3 * nready] =
+	    processx__poll_bytes(INTEGER(types)[i], &pollables[j]);
+	}
+	k++;
+      }
+    }
+  }
+
+  dimnames = PROTECT(allocVector(VECSXP, 2));
+  colnames = PROTECT(allocVector(STRSXP, ncol));
+  SET_STRING_ELT(colnames, 0, mkChar("index"));
+  SET_STRING_ELT(colnames, 1, mkChar("stream"));
+  SET_STRING_ELT(colnames, 2, mkChar("event"));
+  if (bytes) SET_STRING_ELT(colnames, 3, mkChar("bytes"));
+  SET_VECTOR_ELT(dimnames, 1, colnames);
+  setAttrib(result, R_DimNamesSymbol, dimnames);
+
+  UNPROTECT(3);
+  return result;
+}
+
+/* Sleep, if there is nothing to poll, but we need to wait for a timer */
+
+static void processx__poll_sleep(int ms) {
+#ifdef _WIN32
+  while (ms > 0) {
+    int chunk = ms < PROCESSX_INTERRUPT_INTERVAL ?
+      ms : PROCESSX_INTERRUPT_INTERVAL;
+    Sleep(chunk);
+    R_CheckUserInterrupt();
+    ms -= chunk;
+  }
+#else
+  processx__interruptible_poll(NULL, 0, ms);
+#endif
+}
+
+/* Poll, with timers that do not have a timerfd. We limit the timeout
+   to the next deadline, and poll again, until something is ready, or
+   a timer fires, or the real timeout is over. */
+
+static void processx__poll_timers(processx_pollable_t *pollables,
+				  int num_poll, int cms,
+				  int *timer_idx, int ntimers) {
+  double deadline = processx__timer_now() + cms;
+  int i;
+
+  while (1) {
+    int wait = -1, waited = 0;
+
+    if (cms >= 0) {
+      double left = ceil(deadline - processx__timer_now());
+      wait = left > 0 ? (int) left : 0;
+    }
+    for (i = 0; i < ntimers; i++) {
+      int rem = processx__timer_remaining(pollables[timer_idx[i]].object);
+      if (rem >= 0 && (wait < 0 || rem < wait)) wait = rem;
+    }
+
+    if (processx_c_connection_poll(pollables, num_poll, wait) > 0) return;
+
+    for (i = 0; i < num_poll; i++) {
+      if (pollables[i].event == PXEVENT) return;
+      if (pollables[i].event == PXTIMEOUT) waited = 1;
+    }
+    for (i = 0; i < ntimers; i++) {
+      if (processx__timer_remaining(pollables[timer_idx[i]].object) == 0) {
+	return;
+      }
+    }
+
+    if (cms >= 0 && processx__timer_now() >= deadline) {
+      for (i = 0; i < num_poll; i++) {
+	if (pollables[i].event == PXSILENT) pollables[i].event = PXTIMEOUT;
+      }
+      return;
+    }
+
+    /* Nothing to poll, processx_c_connection_poll() returned at once */
+    if (!waited) processx__poll_sleep(wait);
+  }
+}
+
+SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms, SEXP sparse,
+		   SEXP bytes) {
   int cms = INTEGER(ms)[0];
+  int csparse = LOGICAL(sparse)[0];
+  int cbytes = LOGICAL(bytes)[0];
   int i, j, num_total = LENGTH(statuses);
   processx_pollable_t *pollables;
   SEXP result;
   int num_proc = 0, num_poll;
+  int *timer_idx, ntimers = 0, nfallback = 0, fired = 0;
 
   for (i = 0; i < num_total; i++) if (INTEGER(types)[i] == 1) num_proc++;
   num_poll = num_total + num_proc * 2;
 
   pollables = (processx_pollable_t*)
     R_alloc(num_poll, sizeof(processx_pollable_t));
+  timer_idx = (int*) R_alloc(num_total, sizeof(int));
 
-  result = PROTECT(allocVector(VECSXP, num_total));
+  result = PROTECT(allocVector(VECSXP, csparse ? 0 : num_total));
   for (i = 0, j = 0; i < num_total; i++) {
     SEXP status = VECTOR_ELT(statuses, i);
     if (INTEGER(types)[i] == 1) {
@@ -35,33 +172,78 @@ SEXP processx_poll(SEXP statuses, SEXP types, SEXP ms) {
       if (cpollconn) cpollconn->poll_idx = j;
       j++;
 
-      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 3));
+      if (!csparse) SET_VECTOR_ELT(result, i, allocVector(INTSXP, 3));
 
     } else if (INTEGER(types)[i] == 2) {
       processx_connection_t *handle = R_ExternalPtrAddr(status);
       processx_c_pollable_from_connection(&pollables[j], handle);
       if (handle) handle->poll_idx = j;
       j++;
-      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
+      if (!csparse) SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
+
+    } else if (INTEGER(types)[i] == 5) {
+      /* Connection, for writing. No poll_idx, that is for reads only. */
+      processx_connection_t *handle = R_ExternalPtrAddr(status);
+      processx_c_pollable_from_connection_write(&pollables[j], handle);
+      j++;
+      if (!csparse) SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
 
     } else if (INTEGER(types)[i] == 3) {
       processx_c_pollable_from_curl(&pollables[j], status);
       j++;
-      SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
+      if (!csparse) SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
+
+    } else if (INTEGER(types)[i] == 4) {
+      processx_timer_t *timer = R_ExternalPtrAddr(status);
+      if (!timer) R_THROW_ERROR("Invalid processx timer object");
+      processx_c_pollable_from_timer(&pollables[j], timer);
+      if (processx__timer_remaining(timer) >= 0) nfallback++;
+      timer_idx[ntimers++] = j;
+      j++;
+      if (!csparse) SET_VECTOR_ELT(result, i, allocVector(INTSXP, 1));
     }
   }
 
-  processx_c_connection_poll(pollables, num_poll, cms);
+  if (nfallback == 0) {
+    processx_c_connection_poll(pollables, num_poll, cms);
+  } else {
+    processx__poll_timers(pollables, num_poll, cms, timer_idx, ntimers);
+  }
+
+  /* Timers that fired are ready, and if one fired, then there was no
+     timeout for the others */
+  for (i = 0; i < ntimers; i++) {
+    processx_pollable_t *el = &pollables[timer_idx[i]];
+    if (processx__timer_check(el->object, el->event)) {
+      el->event = PXREADY;
+      fired++;
+    } else if (el->event == PXREADY) {
+      el->event = PXSILENT;
+    }
+  }
+  if (fired > 0) {
+    for (i = 0; i < num_poll; i++) {
+      if (pollables[i].event == PXTIMEOUT) pollables[i].event = PXSILENT;
+    }
+  }
+
+  if (csparse) {
+    UNPROTECT(1);
+    return processx__poll_sparse(types, num_total, pollables, cbytes);
+  }
 
   for (i = 0, j = 0; i < num_total; i++) {
-    if (INTEGER(types)[i] == 1) {
-      INTEGER(VECTOR_ELT(result, i))[0] = pollables[j++].event;
-      INTEGER(VECTOR_ELT(result, i))[1] = pollables[j++].event;
-      INTEGER(VECTOR_ELT(result, i))[2] = pollables[j++].event;
-    } else if (INTEGER(types)[i] == 2) {
-      INTEGER(VECTOR_ELT(result, i))[0] = pollables[j++].event;
-    } else {
-      INTEGER(VECTOR_ELT(result, i))[0] = pollables[j++].event;
+    SEXP elt = VECTOR_ELT(result, i);
+    int s, type = INTEGER(types)[i], n = LENGTH(elt);
+    SEXP avail = R_NilValue;
+    if (cbytes) {
+      avail = PROTECT(allocVector(INTSXP, n));
+      setAttrib(elt, install("bytes"), avail);
+      UNPROTECT(1);
+    }
+    for (s = 0; s < n; s++, j++) {
+      INTEGER(elt)[s] = pollables[j].event;
+      if (cbytes) INTEGER(avail)[s] = processx__poll_bytes(type, &pollables[j]);
     }
   }
 
@@ -0,0 +1,1077 @@
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+/* IORING_FEAT_FAST_POLL is from Linux 5.7, which has everything we need */
+#if defined(IORING_FEAT_FAST_POLL) && defined(__NR_io_uring_setup)
+#define PROCESSX__URING 1
+#endif
+
+#include "processx.h"
+
+#ifdef __linux__
+#include <R_ext/eventloop.h>
+#endif
+
+/* Persistent pollers
+ *
+ * `poll()` builds the list of pollables from scratch, and calls the
+ * pre-poll function of every connection, every time. This is fine for a
+ * couple of processes, but not for thousands of them. A poller keeps its
+ * connections registered between calls.
+ *
+ * On Linux the file descriptors are in an epoll set, and we only look
+ * at the connections that epoll reports. Connections might also have
+ * data in their buffers, that the OS does not know about. These are on
+ * the candidate list: a connection is added to it when we read from it,
+ * or when it is closed, and it stays there as long as its pre-poll
+ * function reports it as ready. So the cost of a poll is proportional
+ * to the number of ready connections, not to the number of registered
+ * ones.
+ *
+ * Elsewhere we fall back to `processx_c_connection_poll()` on all
+ * registered connections. This still saves the work on the R side.
+ *
+ * On Linux 5.7 and above the poller can also use io_uring. Then every
+ * idle connection has a read request in the ring, into the free part
+ * of its raw buffer, and a poll only submits the new requests and
+ * reaps the completions. The next `processx__connection_read()` picks
+ * up the data from the buffer, without a read() call. The connection
+ * code must not touch the free part of the buffer while the read is in
+ * flight, so reading, growing the buffer, closing and polling the
+ * connection outside of the poller cancel the request first, see
+ * `processx__poller_touch()` and `processx__poller_release()`. If
+ * io_uring is not available, we use epoll.
+ *
+ * On Linux a poller can also be attached to the R event loop, with an
+ * input handler. R waits on a single fd for it, another epoll set that
+ * contains the epoll fd or the ring fd of the poller, and an eventfd.
+ * The candidates are not visible to the kernel, so after every
+ * dispatch we write to the eventfd if some of them are still ready, and
+ * R calls us again.
+ */
+
+/* io_uring state of a connection */
+#define PROCESSX__URING_IDLE      0 /* nothing in the ring */
+#define PROCESSX__URING_READ      1 /* read in flight */
+#define PROCESSX__URING_POLL      2 /* poll in flight */
+#define PROCESSX__URING_READ_DONE 3 /* read completed, not picked up */
+#define PROCESSX__URING_POLL_DONE 4 /* poll completed */
+
+typedef struct processx_poller_item_s {
+  struct processx_poller_s *poller;
+  processx_connection_t *ccon;
+  int id;			/* id of the R object in the poller */
+  int which;			/* 0: output/connection, 1: error, 2: process */
+  int candidate;		/* whether it is on the candidate list */
+  int nofd;			/* cannot be in the epoll set, e.g. a file */
+  unsigned int ready;		/* poll generation it was reported in */
+  int uring;			/* io_uring state, see above */
+  int uring_res;		/* result of the completed request */
+  size_t uring_offset;		/* where the read goes in the buffer */
+  int uring_nowait;		/* reads fail with EAGAIN, poll instead */
+  int idle;			/* whether it is on the idle list */
+} processx_poller_item_t;
+
+#ifdef PROCESSX__URING
+
+typedef struct processx__uring_s {
+  int fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned unsubmitted;
+} processx__uring_t;
+
+#endif
+
+typedef struct processx_poller_s {
+  processx_poller_item_t **items;
+  size_t nitems, items_size;
+  processx_poller_item_t **candidates;
+  size_t ncandidates, candidates_size;
+  processx_poller_item_t **idle; /* need a new io_uring request */
+  size_t nidle, idle_size;
+  unsigned int generation;	/* number of polls, to mark the results */
+  int epfd;
+#ifdef PROCESSX__URING
+  processx__uring_t *uring;
+#endif
+#ifdef __linux__
+  InputHandler *handler;	/* attached to the R event loop */
+  int handler_fd;		/* epoll set for the input handler */
+  int kick_fd;			/* eventfd, for the candidates */
+  int dispatching;
+#endif
+} processx_poller_t;
+
+#ifdef PROCESSX__URING
+#define processx__poller_uring(poller) ((poller)->uring != NULL)
+#else
+#define processx__poller_uring(poller) 0
+#endif
+
+static void *processx__poller_grow(void *ptr, size_t *size, size_t elsize) {
+  size_t newsize = *size ? *size * 2 : 16;
+  void *newptr = realloc(ptr, newsize * elsize);
+  if (!newptr) R_THROW_ERROR("Cannot allocate memory for processx poller");
+  *size = newsize;
+  return newptr;
+}
+
+static void processx__poller_candidate(processx_poller_item_t *item) {
+  processx_poller_t *poller = item->poller;
+  if (item->candidate) return;
+  if (poller->ncandidates == poller->candidates_size) {
+    /* This might be called from a read, so don't throw */
+    size_t newsize = poller->candidates_size ?
+      poller->candidates_size * 2 : 16;
+    void *newptr = realloc(poller->candidates, newsize * sizeof(item));
+    if (!newptr) return;
+    poller->candidates = newptr;
+    poller->candidates_size = newsize;
+  }
+  poller->candidates[poller->ncandidates++] = item;
+  item->candidate = 1;
+}
+
+#ifdef PROCESSX__URING
+
+#define PROCESSX__URING_SQ_ENTRIES 256
+#define PROCESSX__URING_CQ_ENTRIES 4096
+
+static void processx__poller_idle(processx_poller_item_t *item) {
+  processx_poller_t *poller = item->poller;
+  if (item->idle) return;
+  if (poller->nidle == poller->idle_size) {
+    /* This might be called from a read, so don't throw */
+    size_t newsize = poller->idle_size ? poller->idle_size * 2 : 16;
+    void *newptr = realloc(poller->idle, newsize * sizeof(item));
+    if (!newptr) return;
+    poller->idle = newptr;
+    poller->idle_size = newsize;
+  }
+  poller->idle[poller->nidle++] = item;
+  item->idle = 1;
+}
+
+static int processx__uring_probe(int fd) {
+  int ops[] = { IORING_OP_READ, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+  struct io_uring_probe *probe;
+  int i, ok = 1;
+
+  probe = calloc(1, sizeof(struct io_uring_probe) +
+		 256 * sizeof(struct io_uring_probe_op));
+  if (!probe) return 0;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	      probe, 256) < 0) {
+    ok = 0;
+  }
+  for (i = 0; ok && i < 3; i++) {
+    ok = ops[i] <= probe->last_op &&
+      (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return ok;
+}
+
+static void processx__uring_destroy(processx__uring_t *ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->ring) munmap(ring->ring, ring->ring_size);
+  if (ring->fd >= 0) close(ring->fd);
+  free(ring);
+}
+
+/* NULL if io_uring is not available, e.g. old kernel, or seccomp */
+
+static processx__uring_t *processx__uring_create(void) {
+  struct io_uring_params params;
+  processx__uring_t *ring = calloc(1, sizeof(processx__uring_t));
+  unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+    IORING_FEAT_FAST_POLL;
+  size_t sq_size, cq_size;
+  char *ptr;
+
+  if (!ring) return NULL;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = PROCESSX__URING_CQ_ENTRIES;
+  ring->fd = (int) syscall(__NR_io_uring_setup, PROCESSX__URING_SQ_ENTRIES,
+			   &params);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+  if ((params.features & features) != features ||
+      !processx__uring_probe(ring->fd)) {
+    goto fail;
+  }
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring == MAP_FAILED) {
+    ring->ring = NULL;
+    goto fail;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  ptr = ring->ring;
+  ring->sq_head = (unsigned*) (ptr + params.sq_off.head);
+  ring->sq_tail = (unsigned*) (ptr + params.sq_off.tail);
+  ring->sq_array = (unsigned*) (ptr + params.sq_off.array);
+  ring->sq_mask = *(unsigned*) (ptr + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (unsigned*) (ptr + params.cq_off.head);
+  ring->cq_tail = (unsigned*) (ptr + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*) (ptr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (ptr + params.cq_off.cqes);
+  return ring;
+
+ fail:
+  processx__uring_destroy(ring);
+  return NULL;
+}
+
+/* Submit the new requests, and wait for `wait` completions. Returns -1
+   on error, but EBUSY and EAGAIN are not errors, we'll try again after
+   reaping some completions. */
+
+static int processx__uring_submit(processx__uring_t *ring, unsigned wait) {
+  int ret;
+  do {
+    ret = (int) syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted,
+			wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret == -1 && errno == EINTR);
+  ring->unsubmitted = *ring->sq_tail -
+    __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ret == -1 && (errno == EBUSY || errno == EAGAIN)) ret = 0;
+  return ret;
+}
+
+/* Go over the completions. Finished requests are added to `ready`,
+   unless it is NULL. */
+
+static void processx__uring_reap(processx_poller_t *poller,
+				 processx_poller_item_t **ready,
+				 int *events, size_t *nready) {
+  processx__uring_t *ring = poller->uring;
+  unsigned head = *ring->cq_head;
+  unsigned tail;
+
+  while (head != (tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))) {
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      processx_poller_item_t *item =
+	(processx_poller_item_t*) (uintptr_t) cqe->user_data;
+      int res = cqe->res;
+
+      /* Completion of a cancellation */
+      if (!item) continue;
+
+      if (res == -ECANCELED ||
+	  (item->uring == PROCESSX__URING_READ && res == -EAGAIN)) {
+	/* Older kernels do not wait on non-blocking fds */
+	if (res == -EAGAIN) item->uring_nowait = 1;
+	item->uring = PROCESSX__URING_IDLE;
+	processx__poller_idle(item);
+	continue;
+      }
+
+      item->uring = item->uring == PROCESSX__URING_READ ?
+	PROCESSX__URING_READ_DONE : PROCESSX__URING_POLL_DONE;
+      item->uring_res = res;
+      processx__poller_candidate(item);
+      if (ready && item->ready != poller->generation) {
+	ready[*nready] = item;
+	events[(*nready)++] = PXREADY;
+	item->ready = poller->generation;
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+static struct io_uring_sqe *processx__uring_sqe(processx_poller_t *poller) {
+  processx__uring_t *ring = poller->uring;
+  unsigned tail = *ring->sq_tail;
+  unsigned idx = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe;
+
+  while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+	 ring->sq_entries) {
+    if (processx__uring_submit(ring, 0) == -1) return NULL;
+    processx__uring_reap(poller, NULL, NULL, NULL);
+  }
+
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  return sqe;
+}
+
+static void processx__uring_push(processx__uring_t *ring) {
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->unsubmitted++;
+}
+
+/* Cancel the request in flight, and wait until it is gone. If it has
+   completed in the meanwhile, then its result is kept. */
+
+static void processx__uring_cancel(processx_poller_item_t *item) {
+  processx_poller_t *poller = item->poller;
+  struct io_uring_sqe *sqe;
+
+  if (item->uring != PROCESSX__URING_READ &&
+      item->uring != PROCESSX__URING_POLL) {
+    return;
+  }
+
+  sqe = processx__uring_sqe(poller);
+  if (sqe) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) item;
+    processx__uring_push(poller->uring);
+  }
+
+  while (item->uring == PROCESSX__URING_READ ||
+	 item->uring == PROCESSX__URING_POLL) {
+    if (!sqe || processx__uring_submit(poller->uring, 1) == -1) {
+      /* Should not happen, but we cannot wait forever */
+      item->uring = PROCESSX__URING_IDLE;
+      break;
+    }
+    processx__uring_reap(poller, NULL, NULL, NULL);
+  }
+}
+
+/* Pick up the result of a completed read. The data is where the
+   buffer ended when we submitted the read, we move it to the current
+   end of the buffer. Returns the number of bytes, zero at EOF, or -1 if
+   there is nothing, and the caller needs to read() itself. */
+
+static ssize_t processx__uring_take(processx_poller_item_t *item) {
+  processx_connection_t *ccon = item->ccon;
+  ssize_t res;
+
+  processx__uring_cancel(item);
+
+  if (item->uring == PROCESSX__URING_POLL_DONE) {
+    item->uring = PROCESSX__URING_IDLE;
+    processx__poller_idle(item);
+  }
+  if (item->uring != PROCESSX__URING_READ_DONE) return -1;
+
+  res = item->uring_res;
+  if (res > 0 && item->uring_offset != ccon->buffer_data_size) {
+    memmove(ccon->buffer + ccon->buffer_data_size,
+	    ccon->buffer + item->uring_offset, res);
+  }
+  item->uring = PROCESSX__URING_IDLE;
+  processx__poller_idle(item);
+  return res < 0 ? -1 : res;
+}
+
+/* Submit requests for the idle connections. Ready connections are left
+   alone, until their data is read. */
+
+static void processx__uring_arm(processx_poller_t *poller) {
+  size_t i;
+
+  for (i = 0; i < poller->nidle; ) {
+    processx_poller_item_t *item = poller->idle[i];
+    processx_connection_t *ccon = item->ccon;
+    struct io_uring_sqe *sqe;
+    size_t todo;
+
+    if (item->candidate) {
+      i++;
+      continue;
+    }
+    poller->idle[i] = poller->idle[--poller->nidle];
+    item->idle = 0;
+    if (item->nofd || item->uring != PROCESSX__URING_IDLE ||
+	ccon->is_closed_ || ccon->is_eof_raw_) {
+      continue;
+    }
+
+    sqe = processx__uring_sqe(poller);
+    if (!sqe) {
+      R_THROW_SYSTEM_ERROR("Cannot submit io_uring requests in "
+			   "processx poller");
+    }
+    sqe->fd = ccon->handle;
+    sqe->user_data = (uintptr_t) item;
+    todo = ccon->buffer ?
+      ccon->buffer_allocated_size - ccon->buffer_data_size : 0;
+    if (todo > 0 && !item->uring_nowait &&
+	ccon->type != PROCESSX_FILE_TYPE_PIDFD) {
+      sqe->opcode = IORING_OP_READ;
+      sqe->addr = (uintptr_t) (ccon->buffer + ccon->buffer_data_size);
+      sqe->len = todo > UINT_MAX ? UINT_MAX : (unsigned) todo;
+      sqe->off = (uint64_t) -1;	/* current position, like read() */
+      item->uring_offset = ccon->buffer_data_size;
+      item->uring = PROCESSX__URING_READ;
+    } else {
+      /* No buffer yet, or a pidfd, just wait until it is readable */
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll_events = POLLIN;
+      item->uring = PROCESSX__URING_POLL;
+    }
+    processx__uring_push(poller->uring);
+  }
+}
+
+#endif
+
+static void processx__poller_remove_item(processx_poller_t *poller,
+					 size_t idx) {
+  processx_poller_item_t *item = poller->items[idx];
+  size_t i;
+
+#ifdef PROCESSX__URING
+  if (poller->uring && item->ccon) {
+    /* The connection might be used without the poller from now on */
+    ssize_t res = processx__uring_take(item);
+    if (res > 0) item->ccon->buffer_data_size += res;
+    if (res == 0) item->ccon->is_eof_raw_ = 1;
+  }
+#endif
+
+  if (item->candidate) {
+    for (i = 0; i < poller->ncandidates; i++) {
+      if (poller->candidates[i] == item) {
+	poller->candidates[i] = poller->candidates[--poller->ncandidates];
+	break;
+      }
+    }
+  }
+
+  if (item->idle) {
+    for (i = 0; i < poller->nidle; i++) {
+      if (poller->idle[i] == item) {
+	poller->idle[i] = poller->idle[--poller->nidle];
+	break;
+      }
+    }
+  }
+
+#ifdef __linux__
+  if (item->ccon && !item->nofd && !item->ccon->is_closed_ &&
+      poller->epfd >= 0) {
+    epoll_ctl(poller->epfd, EPOLL_CTL_DEL, item->ccon->handle, NULL);
+  }
+#endif
+
+  if (item->ccon) item->ccon->poller_item = NULL;
+  free(item);
+  poller->items[idx] = poller->items[--poller->nitems];
+}
+
+/* Called from the connection code */
+
+/* Called before reading from the connection. Returns the number of
+   bytes that io_uring has read into the buffer already, but these are
+   not added to `buffer_data_size` yet. Zero means EOF, and -1 means
+   that the caller needs to read() itself. */
+
+ssize_t processx__poller_touch(processx_connection_t *ccon) {
+  processx_poller_item_t *item = ccon->poller_item;
+  processx__poller_candidate(item);
+#ifdef PROCESSX__URING
+  if (item->poller->uring) return processx__uring_take(item);
+#endif
+  return -1;
+}
+
+/* Called before the raw buffer is reallocated */
+
+void processx__poller_release(processx_connection_t *ccon) {
+#ifdef PROCESSX__URING
+  processx_poller_item_t *item = ccon->poller_item;
+  if (item->poller->uring && item->uring == PROCESSX__URING_READ) {
+    processx__uring_cancel(item);
+  }
+#endif
+}
+
+/* Whether there is a read in flight, or data waiting in the buffer.
+   Then the fd itself cannot be polled, the caller needs to read first. */
+
+int processx__poller_pending(processx_connection_t *ccon) {
+#ifdef PROCESSX__URING
+  processx_poller_item_t *item = ccon->poller_item;
+  return item->uring == PROCESSX__URING_READ ||
+    item->uring == PROCESSX__URING_READ_DONE;
+#else
+  return 0;
+#endif
+}
+
+void processx__poller_closed(processx_connection_t *ccon) {
+  processx_poller_item_t *item = ccon->poller_item;
+#ifdef PROCESSX__URING
+  /* The fd stays open until the requests on it are done */
+  if (item->poller->uring) processx__uring_cancel(item);
+#endif
+#ifdef __linux__
+  /* Need to do this before the fd is closed */
+  if (!item->nofd && !ccon->is_closed_ && item->poller->epfd >= 0) {
+    epoll_ctl(item->poller->epfd, EPOLL_CTL_DEL, ccon->handle, NULL);
+  }
+  item->nofd = 1;
+#endif
+  processx__poller_candidate(item);
+}
+
+void processx__poller_forget(processx_connection_t *ccon) {
+  processx_poller_item_t *item = ccon->poller_item;
+  processx_poller_t *poller = item->poller;
+  size_t i;
+  for (i = 0; i < poller->nitems; i++) {
+    if (poller->items[i] == item) {
+      processx__poller_remove_item(poller, i);
+      break;
+    }
+  }
+}
+
+#ifdef __linux__
+static void processx__poller_unhandle(processx_poller_t *poller);
+#endif
+
+static void processx__poller_finalizer(SEXP ptr) {
+  processx_poller_t *poller = R_ExternalPtrAddr(ptr);
+  if (!poller) return;
+#ifdef __linux__
+  /* Only at exit, an attached poller is not garbage collected */
+  processx__poller_unhandle(poller);
+#endif
+  while (poller->nitems > 0) {
+    processx__poller_remove_item(poller, poller->nitems - 1);
+  }
+#ifdef __linux__
+  if (poller->epfd >= 0) close(poller->epfd);
+#endif
+#ifdef PROCESSX__URING
+  if (poller->uring) processx__uring_destroy(poller->uring);
+#endif
+  free(poller->items);
+  free(poller->candidates);
+  free(poller->idle);
+  free(poller);
+  R_ClearExternalPtr(ptr);
+}
+
+static processx_poller_t *processx__poller_get(SEXP ptr) {
+  processx_poller_t *poller = R_ExternalPtrAddr(ptr);
+  if (!poller) R_THROW_ERROR("Invalid processx poller object");
+  return poller;
+}
+
+SEXP processx_poller_create(SEXP io_uring) {
+  processx_poller_t *poller = calloc(1, sizeof(processx_poller_t));
+  SEXP result;
+  if (!poller) R_THROW_ERROR("Cannot allocate memory for processx poller");
+  poller->epfd = -1;
+#ifdef __linux__
+  poller->handler_fd = poller->kick_fd = -1;
+#endif
+
+#ifdef PROCESSX__URING
+  /* Falls back to epoll if io_uring is not available */
+  if (LOGICAL(io_uring)[0]) poller->uring = processx__uring_create();
+#endif
+
+#ifdef __linux__
+  if (!processx__poller_uring(poller)) {
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd == -1) {
+      free(poller);
+      R_THROW_SYSTEM_ERROR("Cannot create epoll instance for processx "
+			   "poller");
+    }
+  }
+#endif
+
+  result = PROTECT(R_MakeExternalPtr(poller, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(result, processx__poller_finalizer, 1);
+  UNPROTECT(1);
+  return result;
+}
+
+static void processx__poller_add1(processx_poller_t *poller,
+				  processx_connection_t *ccon,
+				  int id, int which) {
+  processx_poller_item_t *item;
+
+  if (!ccon) return;
+  if (ccon->poller_item) {
+    R_THROW_ERROR("Connection is already registered in a poller");
+  }
+#ifndef _WIN32
+  if (ccon->reader) {
+    R_THROW_ERROR("Cannot add a connection with a background reader to "
+		  "a poller");
+  }
+#endif
+
+  if (poller->nitems == poller->items_size) {
+    poller->items = processx__poller_grow(poller->items,
+					  &poller->items_size,
+					  sizeof(processx_poller_item_t*));
+  }
+
+  item = calloc(1, sizeof(processx_poller_item_t));
+  if (!item) R_THROW_ERROR("Cannot allocate memory for processx poller");
+  item->poller = poller;
+  item->ccon = ccon;
+  item->id = id;
+  item->which = which;
+
+#ifdef __linux__
+  if (ccon->is_closed_) {
+    item->nofd = 1;
+  } else if (processx__poller_uring(poller)) {
+    /* Regular files are always readable, like for poll() */
+    struct stat st;
+    if (fstat(ccon->handle, &st) == 0 && S_ISREG(st.st_mode)) {
+      item->nofd = 1;
+    }
+  } else {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = item;
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, ccon->handle, &ev)) {
+      /* Regular files are always readable, like for poll() */
+      if (errno != EPERM) {
+	free(item);
+	R_THROW_SYSTEM_ERROR("Cannot add connection to processx poller");
+      }
+      item->nofd = 1;
+    }
+  }
+#endif
+
+  poller->items[poller->nitems++] = item;
+  ccon->poller_item = item;
+#ifdef PROCESSX__URING
+  if (poller->uring) processx__poller_idle(item);
+#endif
+
+  /* It might have buffered data already */
+  processx__poller_candidate(item);
+}
+
+SEXP processx_poller_add(SEXP ptr, SEXP id, SEXP type, SEXP object) {
+  processx_poller_t *poller = processx__poller_get(ptr);
+  int cid = INTEGER(id)[0];
+
+  if (INTEGER(type)[0] == 1) {
+    processx_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(object, 0));
+    SEXP pollconn = VECTOR_ELT(object, 1);
+    if (!handle) R_THROW_ERROR("Invalid process object");
+    processx__poller_add1(poller, handle->pipes[1], cid, 0);
+    processx__poller_add1(poller, handle->pipes[2], cid, 1);
+    if (!isNull(pollconn)) {
+      processx__poller_add1(poller, R_ExternalPtrAddr(pollconn), cid, 2);
+    }
+  } else {
+    processx_connection_t *ccon = R_ExternalPtrAddr(object);
+    if (!ccon) R_THROW_ERROR("Invalid connection object");
+    processx__poller_add1(poller, ccon, cid, 0);
+  }
+
+  return R_NilValue;
+}
+
+SEXP processx_poller_remove(SEXP ptr, SEXP id) {
+  processx_poller_t *poller = processx__poller_get(ptr);
+  int cid = INTEGER(id)[0];
+  size_t i = 0;
+
+  while (i < poller->nitems) {
+    if (poller->items[i]->id == cid) {
+      processx__poller_remove_item(poller, i);
+    } else {
+      i++;
+    }
+  }
+
+  return R_NilValue;
+}
+
+/* The result is a list of three integer vectors, the ids, the streams
+   (see `which` above), and the poll codes of the ready connections. */
+
+static SEXP processx__poller_result(processx_poller_item_t **ready,
+				    int *events, size_t nready) {
+  const char *names[] = { "id", "which", "event", "" };
+  SEXP result = PROTECT(mkNamed(VECSXP, names));
+  SEXP rid = PROTECT(allocVector(INTSXP, nready));
+  SEXP rwhich = PROTECT(allocVector(INTSXP, nready));
+  SEXP revent = PROTECT(allocVector(INTSXP, nready));
+  size_t i;
+
+  for (i = 0; i < nready; i++) {
+    INTEGER(rid)[i] = ready[i]->id;
+    INTEGER(rwhich)[i] = ready[i]->which;
+    INTEGER(revent)[i] = events[i];
+  }
+
+  SET_VECTOR_ELT(result, 0, rid);
+  SET_VECTOR_ELT(result, 1, rwhich);
+  SET_VECTOR_ELT(result, 2, revent);
+  UNPROTECT(4);
+  return result;
+}
+
+#ifdef __linux__
+
+/* Connections with buffered data, or closed ones. The rest are
+   removed from the candidate list. */
+
+static size_t processx__poller_candidates(processx_poller_t *poller,
+					  processx_poller_item_t **ready,
+					  int *events) {
+  size_t i, nready = 0;
+  for (i = 0; i < poller->ncandidates; ) {
+    processx_poller_item_t *item = poller->candidates[i];
+    processx_pollable_t pollable;
+    int ev;
+    processx_c_pollable_from_connection(&pollable, item->ccon);
+    ev = pollable.pre_poll_func(&pollable);
+    if (ev == PXHANDLE && item->nofd) ev = PXREADY;
+    if (ev == PXHANDLE && item->uring == PROCESSX__URING_POLL_DONE) {
+      ev = PXREADY;
+    }
+    if (ev == PXREADY || ev == PXCLOSED) {
+      ready[nready] = item;
+      events[nready++] = ev;
+      item->ready = poller->generation;
+      i++;
+    } else {
+      item->candidate = 0;
+      poller->candidates[i] = poller->candidates[--poller->ncandidates];
+    }
+  }
+  return nready;
+}
+
+#ifdef PROCESSX__URING
+
+static SEXP processx__uring_poll(processx_poller_t *poller, int cms) {
+  processx_poller_item_t **ready;
+  int *events;
+  size_t nready, maxready = poller->nitems > 0 ? poller->nitems : 1;
+  struct pollfd pfd;
+  int ret;
+
+  ready = (processx_poller_item_t**)
+    R_alloc(maxready, sizeof(processx_poller_item_t*));
+  events = (int*) R_alloc(maxready, sizeof(int));
+
+  nready = processx__poller_candidates(poller, ready, events);
+
+  processx__uring_arm(poller);
+  if (processx__uring_submit(poller->uring, 0) == -1) {
+    R_THROW_SYSTEM_ERROR("Cannot submit io_uring requests in "
+			 "processx poller");
+  }
+
+  /* Like for epoll, wait on the ring fd, for interrupts and the write
+     queues. It is readable if there are completions. */
+  pfd.fd = poller->uring->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  ret = processx__interruptible_poll(&pfd, 1, nready > 0 ? 0 : cms);
+  if (ret == -1) R_THROW_SYSTEM_ERROR("Processx poller error");
+
+  processx__uring_reap(poller, ready, events, &nready);
+
+  return processx__poller_result(ready, events, nready);
+}
+
+#endif
+
+#define PROCESSX__POLLER_MAXEVENTS 1024
+
+SEXP processx_poller_poll(SEXP ptr, SEXP ms) {
+  processx_poller_t *poller = processx__poller_get(ptr);
+  int cms = INTEGER(ms)[0];
+  processx_poller_item_t **ready;
+  int *events;
+  size_t i, nready, maxready;
+  int maxevents, ret;
+  struct epoll_event *evs;
+  struct pollfd pfd;
+
+  poller->generation++;
+
+#ifdef PROCESSX__URING
+  if (poller->uring) return processx__uring_poll(poller, cms);
+#endif
+
+  maxevents = poller->nitems < PROCESSX__POLLER_MAXEVENTS ?
+    (int) poller->nitems : PROCESSX__POLLER_MAXEVENTS;
+  if (maxevents == 0) maxevents = 1;
+  maxready = poller->ncandidates + maxevents;
+  ready = (processx_poller_item_t**)
+    R_alloc(maxready, sizeof(processx_poller_item_t*));
+  events = (int*) R_alloc(maxready, sizeof(int));
+  evs = (struct epoll_event*)
+    R_alloc(maxevents, sizeof(struct epoll_event));
+
+  nready = processx__poller_candidates(poller, ready, events);
+
+  /* Wait on the epoll fd itself, this takes care of interrupts, and
+     of the write queues of the connections. */
+  pfd.fd = poller->epfd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  ret = processx__interruptible_poll(&pfd, 1, nready > 0 ? 0 : cms);
+  if (ret == -1) R_THROW_SYSTEM_ERROR("Processx poller error");
+  if (ret == 0) return processx__poller_result(ready, events, nready);
+
+  do {
+    ret = epoll_wait(poller->epfd, evs, maxevents, 0);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1) R_THROW_SYSTEM_ERROR("Processx poller error");
+
+  for (i = 0; i < (size_t) ret; i++) {
+    processx_poller_item_t *item = evs[i].data.ptr;
+    if (item->ready == poller->generation) continue;
+    ready[nready] = item;
+    events[nready++] = PXREADY;
+    item->ready = poller->generation;
+  }
+
+  return processx__poller_result(ready, events, nready);
+}
+
+#else
+
+SEXP processx_poller_poll(SEXP ptr, SEXP ms) {
+  processx_poller_t *poller = processx__poller_get(ptr);
+  int cms = INTEGER(ms)[0];
+  processx_pollable_t *pollables;
+  processx_poller_item_t **ready;
+  int *events;
+  size_t i, nready = 0;
+
+  if (poller->nitems == 0) {
+    return processx__poller_result(NULL, NULL, 0);
+  }
+
+  pollables = (processx_pollable_t*)
+    R_alloc(poller->nitems, sizeof(processx_pollable_t));
+  ready = (processx_poller_item_t**)
+    R_alloc(poller->nitems, sizeof(processx_poller_item_t*));
+  events = (int*) R_alloc(poller->nitems, sizeof(int));
+
+  for (i = 0; i < poller->nitems; i++) {
+    processx_c_pollable_from_connection(&pollables[i],
+					poller->items[i]->ccon);
+  }
+
+  processx_c_connection_poll(pollables, poller->nitems, cms);
+
+  for (i = 0; i < poller->nitems; i++) {
+    int ev = pollables[i].event;
+    if (ev == PXREADY || ev == PXCLOSED) {
+      ready[nready] = poller->items[i];
+      events[nready++] = ev;
+    }
+  }
+
+  /* We don't use the candidate list here */
+  poller->ncandidates = 0;
+  for (i = 0; i < poller->nitems; i++) poller->items[i]->candidate = 0;
+
+  return processx__poller_result(ready, events, nready);
+}
+
+#endif
+
+SEXP processx_poller_info(SEXP ptr) {
+  processx_poller_t *poller = processx__poller_get(ptr);
+  const char *names[] = { "backend", "connections", "candidates", "" };
+  SEXP result = PROTECT(mkNamed(VECSXP, names));
+#ifdef __linux__
+  SET_VECTOR_ELT(result, 0, mkString(processx__poller_uring(poller) ?
+				     "io_uring" : "epoll"));
+#else
+  SET_VECTOR_ELT(result, 0, mkString("poll"));
+#endif
+  SET_VECTOR_ELT(result, 1, ScalarInteger((int) poller->nitems));
+  SET_VECTOR_ELT(result, 2, ScalarInteger((int) poller->ncandidates));
+  UNPROTECT(1);
+  return result;
+}
+
+/* Attaching to the R event loop ---------------------------------------- */
+
+#ifdef __linux__
+
+/* An arbitrary number, R does not use it for input handlers */
+#define PROCESSX__POLLER_ACTIVITY 71
+
+/* After a dispatch: submit the new io_uring requests, and wake up R
+   again if some candidates are ready. */
+
+static void processx__poller_rearm(processx_poller_t *poller) {
+  const void *vmax = vmaxget();
+
+  /* This also drops the candidates that are not ready, so they can
+     get new io_uring requests */
+  if (poller->ncandidates > 0) {
+    processx_poller_item_t **ready = (processx_poller_item_t**)
+      R_alloc(poller->ncandidates, sizeof(processx_poller_item_t*));
+    int *events = (int*) R_alloc(poller->ncandidates, sizeof(int));
+    if (processx__poller_candidates(poller, ready, events) > 0) {
+      uint64_t one = 1;
+      if (write(poller->kick_fd, &one, sizeof(one)) == -1) {
+	/* The counter is not zero, so R will call us anyway */
+      }
+    }
+  }
+
+#ifdef PROCESSX__URING
+  if (poller->uring) {
+    processx__uring_arm(poller);
+    if (processx__uring_submit(poller->uring, 0) == -1) {
+      R_THROW_SYSTEM_ERROR("Cannot submit io_uring requests in "
+			   "processx poller");
+    }
+  }
+#endif
+
+  vmaxset(vmax);
+}
+
+static void processx__poller_handler(void *data) {
+  SEXP ptr = (SEXP) data;
+  processx_poller_t *poller = R_ExternalPtrAddr(ptr);
+  uint64_t count;
+  SEXP call;
+  int error;
+
+  /* A callback might run the event loop, e.g. in Sys.sleep(). We
+     don't call it recursively. */
+  if (!poller || poller->dispatching) return;
+
+  if (read(poller->kick_fd, &count, sizeof(count)) == -1) {
+    /* Not kicked, fine */
+  }
+
+  poller->dispatching = 1;
+  call = PROTECT(lang1(R_ExternalPtrProtected(ptr)));
+  R_tryEval(call, R_GlobalEnv, &error);
+  UNPROTECT(1);
+  poller->dispatching = 0;
+
+  /* The callback might have detached the poller */
+  if (poller->handler) processx__poller_rearm(poller);
+}
+
+static void processx__poller_unhandle(processx_poller_t *poller) {
+  if (poller->handler) {
+    removeInputHandler(&R_InputHandlers, poller->handler);
+    poller->handler = NULL;
+  }
+  if (poller->handler_fd >= 0) close(poller->handler_fd);
+  if (poller->kick_fd >= 0) close(poller->kick_fd);
+  poller->handler_fd = poller->kick_fd = -1;
+}
+
+SEXP processx_poller_attach(SEXP ptr, SEXP callback) {
+  processx_poller_t *poller = processx__poller_get(ptr);
+  struct epoll_event ev;
+  int fd = poller->epfd;
+
+#ifdef PROCESSX__URING
+  if (poller->uring) fd = poller->uring->fd;
+#endif
+
+  if (poller->handler) {
+    R_THROW_ERROR("Poller is already attached to the event loop");
+  }
+
+  poller->handler_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (poller->handler_fd == -1) goto error;
+  poller->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (poller->kick_fd == -1) goto error;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if (epoll_ctl(poller->handler_fd, EPOLL_CTL_ADD, fd, &ev)) goto error;
+  if (epoll_ctl(poller->handler_fd, EPOLL_CTL_ADD, poller->kick_fd, &ev)) {
+    goto error;
+  }
+
+  poller->handler = addInputHandler(R_InputHandlers, poller->handler_fd,
+				    processx__poller_handler,
+				    PROCESSX__POLLER_ACTIVITY);
+  if (!poller->handler) goto error;
+  poller->handler->userData = ptr;
+
+  /* The handler refers to the poller, so it must stay alive */
+  R_SetExternalPtrProtected(ptr, callback);
+  R_PreserveObject(ptr);
+
+  /* There might be buffered data already */
+  processx__poller_rearm(poller);
+
+  return R_NilValue;
+
+ error:
+  processx__poller_unhandle(poller);
+  R_THROW_SYSTEM_ERROR("Cannot attach processx poller to the event loop");
+  return R_NilValue;
+}
+
+SEXP processx_poller_detach(SEXP ptr) {
+  processx_poller_t *poller = processx__poller_get(ptr);
+  if (!poller->handler) return R_NilValue;
+  processx__poller_unhandle(poller);
+  R_SetExternalPtrProtected(ptr, R_NilValue);
+  R_ReleaseObject(ptr);
+  return R_NilValue;
+}
+
+#else
+
+SEXP processx_poller_attach(SEXP ptr, SEXP callback) {
+  R_THROW_ERROR("Attaching a poller to the event loop is only supported "
+		"on Linux");
+  return R_NilValue;
+}
+
+SEXP processx_poller_detach(SEXP ptr) {
+  return R_NilValue;
+}
+
+#endif
@@ -4,12 +4,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #ifndef _WIN32
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <langinfo.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #else
 #include <io.h>
 #endif
@@ -35,20 +43,55 @@ static void processx__connection_find_lines(processx_connection_t *ccon,
 					    size_t *lines,
 					    int *eof);
 
+static void processx__connection_find_records(processx_connection_t *ccon,
+					      int delim,
+					      ssize_t maxrecords,
+					      size_t *records,
+					      size_t *bytes,
+					      int *eof);
+
+static void processx__connection_find_frames(processx_connection_t *ccon,
+					     int header_size,
+					     int big_endian,
+					     ssize_t maxframes,
+					     size_t max_frame_size,
+					     size_t *frames,
+					     size_t *bytes);
+
 static void processx__connection_alloc(processx_connection_t *ccon);
 static void processx__connection_realloc(processx_connection_t *ccon);
-static ssize_t processx__connection_read(processx_connection_t *ccon);
+static void processx__connection_realloc_raw(processx_connection_t *ccon,
+					     size_t need);
+static void processx__connection_set_binary(processx_connection_t *ccon);
+static void processx__connection_consume_raw(processx_connection_t *ccon,
+					     size_t bytes, int more);
+static SEXP processx__split_lines(const char *data, R_xlen_t size);
+static size_t processx__frame_length(const char *header, int header_size,
+				     int big_endian);
 static ssize_t processx__find_newline(processx_connection_t *ccon,
 				      size_t start);
 static ssize_t processx__connection_read_until_newline(processx_connection_t
 						       *ccon);
 static void processx__connection_xfinalizer(SEXP con);
 static ssize_t processx__connection_to_utf8(processx_connection_t *ccon);
+static int processx__encoding_type(const char *encoding);
+static ssize_t processx__connection_to_utf8_fast(processx_connection_t *ccon);
 static void processx__connection_find_utf8_chars(processx_connection_t *ccon,
 						 ssize_t maxchars,
 						 ssize_t maxbytes,
 						 size_t *chars,
 						 size_t *bytes);
+static size_t processx__connection_find_utf8_bytes(processx_connection_t *ccon,
+						   ssize_t maxbytes);
+static void processx__connection_wqueue_drop(processx_connection_t *ccon);
+#ifndef _WIN32
+static void processx__connection_wqueue_push(processx_connection_t *ccon,
+					     SEXP bytes, size_t offset);
+static int processx__connection_wqueue_drain(processx_connection_t *ccon);
+static ssize_t processx__connection_writev(processx_connection_t *ccon,
+					   struct iovec *iov, int iovcnt);
+static double processx__timestamp(void);
+#endif
 
 #ifdef _WIN32
 #define PROCESSX_CHECK_VALID_CONN(x) do {				\
@@ -145,15 +188,21 @@ SEXP processx_connection_create_file(SEXP filename, SEXP read, SEXP write) {
   return result;
 }
 
-SEXP processx_connection_read_chars(SEXP con, SEXP nchars) {
+SEXP processx_connection_read_chars(SEXP con, SEXP nchars, SEXP nbytes) {
 
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   SEXP result;
   int cnchars = asInteger(nchars);
+  double cnbytes = REAL(nbytes)[0];
   size_t utf8_chars, utf8_bytes;
 
-  processx__connection_find_chars(ccon, cnchars, -1, &utf8_chars,
-				  &utf8_bytes);
+  if (cnchars >= 0 && cnbytes >= 0) {
+    R_THROW_ERROR("Cannot limit both the number of characters and bytes");
+  }
+
+  processx__connection_find_chars(ccon, cnchars,
+				  cnbytes < 0 ? -1 : (ssize_t) cnbytes,
+				  &utf8_chars, &utf8_bytes);
 
   result = PROTECT(ScalarString(mkCharLenCE(ccon->utf8, (int) utf8_bytes,
 					    CE_UTF8)));
@@ -204,18 +253,201 @@ SEXP processx_connection_read_lines(SEXP con, SEXP nlines) {
   return result;
 }
 
+SEXP processx_connection_read_records(SEXP con, SEXP delim, SEXP nrecords) {
+
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  SEXP result;
+  int cdelim = RAW(delim)[0];
+  int cn = asInteger(nrecords);
+  size_t records = 0, bytes = 0, r, start = 0;
+  int eof = 0;
+
+  processx__connection_find_records(ccon, cdelim, cn, &records, &bytes,
+				    &eof);
+
+  result = PROTECT(allocVector(VECSXP, records + eof));
+  for (r = 0; r < records; r++) {
+    const char *rec = ccon->buffer + start;
+    const char *end = memchr(rec, cdelim, bytes - start);
+    size_t len = end - rec;
+    SET_VECTOR_ELT(result, r, allocVector(RAWSXP, len));
+    memcpy(RAW(VECTOR_ELT(result, r)), rec, len);
+    start += len + 1;
+  }
+
+  /* No delimiter at the end of the stream, the rest is the last record */
+  if (eof) {
+    size_t len = ccon->buffer_data_size - start;
+    SET_VECTOR_ELT(result, r, allocVector(RAWSXP, len));
+    memcpy(RAW(VECTOR_ELT(result, r)), ccon->buffer + start, len);
+    bytes = ccon->buffer_data_size;
+  }
+
+  processx__connection_consume_raw(ccon, bytes, cn >= 0 && records == cn);
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_connection_read_frames(SEXP con, SEXP header_size,
+				     SEXP big_endian, SEXP nframes,
+				     SEXP max_frame_size) {
+
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  SEXP result;
+  int chsize = asInteger(header_size);
+  int cbig = LOGICAL(big_endian)[0];
+  int cn = asInteger(nframes);
+  double dmax = REAL(max_frame_size)[0];
+  size_t cmax = dmax >= (double) SIZE_MAX ? SIZE_MAX : (size_t) dmax;
+  size_t frames = 0, bytes = 0, f, start = 0;
+
+  processx__connection_find_frames(ccon, chsize, cbig, cn, cmax, &frames,
+				   &bytes);
+
+  result = PROTECT(allocVector(VECSXP, frames));
+  for (f = 0; f < frames; f++) {
+    size_t len = processx__frame_length(ccon->buffer + start, chsize, cbig);
+    SET_VECTOR_ELT(result, f, allocVector(RAWSXP, len));
+    memcpy(RAW(VECTOR_ELT(result, f)), ccon->buffer + start + chsize, len);
+    start += chsize + len;
+  }
+
+  /* An incomplete frame at the end of the stream is dropped */
+  if (ccon->is_eof_raw_ && (cn < 0 || frames < cn) &&
+      bytes < ccon->buffer_data_size) {
+    warning("Incomplete frame at end of stream ignored");
+    bytes = ccon->buffer_data_size;
+  }
+
+  processx__connection_consume_raw(ccon, bytes, cn >= 0 && frames == cn);
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Read everything until EOF, in a single call. We collect the output in
+   a raw vector, that we grow geometrically, so the total cost is linear
+   in the size of the output. Since this is an R vector, an interrupt
+   during the poll does not leak memory. `type` is 0 for a string, 1 for
+   lines and 2 for a raw vector. */
+
+SEXP processx_connection_read_all(SEXP con, SEXP type) {
+
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  int ctype = asInteger(type);
+  processx_pollable_t pollable;
+  PROTECT_INDEX idx;
+  SEXP buf, result;
+  R_xlen_t size = 0;
+
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  if (ctype == 2) {
+    processx__connection_set_binary(ccon);
+  } else if (ccon->binary) {
+    R_THROW_ERROR("Cannot read text, connection is in binary mode");
+  }
+
+  PROTECT_WITH_INDEX(buf = allocVector(RAWSXP, 64 * 1024), &idx);
+  processx_c_pollable_from_connection(&pollable, ccon);
+
+  while (1) {
+    REPROTECT(buf = processx__connection_drain(ccon, buf, &size), idx);
+    if (ccon->is_eof_) break;
+    /* No need to wait if we know that there is nothing more to come */
+    if (!ccon->is_eof_raw_) processx_c_connection_poll(&pollable, 1, -1);
+    processx__connection_read(ccon);
+  }
+
+  if (ctype == 2) {
+    result = PROTECT(xlengthgets(buf, size));
+
+  } else if (ctype == 1) {
+    result = PROTECT(processx__split_lines((const char*) RAW(buf), size));
+
+  } else {
+    if (size > INT_MAX) {
+      R_THROW_ERROR("Output is too long for a single string, read it as "
+		    "lines or as raw bytes");
+    }
+    result = PROTECT(ScalarString(mkCharLenCE((const char*) RAW(buf),
+					      (int) size, CE_UTF8)));
+  }
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* On Unix, whatever cannot be written right away is queued, and the
+   queue is written out whenever processx polls or waits. */
+
 SEXP processx_connection_write_bytes(SEXP con, SEXP bytes) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   Rbyte *cbytes = RAW(bytes);
   size_t nbytes = LENGTH(bytes);
-  SEXP result;
 
   ssize_t written = processx_c_connection_write_bytes(ccon, cbytes, nbytes);
 
+#ifdef _WIN32
+  SEXP result;
   size_t left = nbytes - written;
   PROTECT(result = allocVector(RAWSXP, left));
   if (left > 0) memcpy(RAW(result), cbytes + written, left);
 
+  UNPROTECT(1);
+  return result;
+#else
+  if (written < nbytes) {
+    processx__connection_wqueue_push(ccon, bytes, written);
+  }
+  return allocVector(RAWSXP, 0);
+#endif
+}
+
+SEXP processx_connection_flush(SEXP con, SEXP timeout) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  int ctimeout = INTEGER(timeout)[0];
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+
+#ifndef _WIN32
+  double deadline = processx__timestamp() + ctimeout;
+  while (ccon->wqueue_head) {
+    struct pollfd fd;
+    int ret;
+    if (processx__connection_wqueue_drain(ccon)) {
+      R_THROW_SYSTEM_ERROR("Cannot write connection");
+    }
+    if (!ccon->wqueue_head) break;
+    if (ctimeout >= 0) {
+      int left = (int) (deadline - processx__timestamp());
+      if (left <= 0) break;
+      ctimeout = left;
+    }
+    fd.fd = ccon->handle;
+    fd.events = POLLOUT;
+    fd.revents = 0;
+    ret = processx__interruptible_poll(&fd, 1, ctimeout);
+    if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot poll connection for writing");
+  }
+  if (ccon->wqueue_error) {
+    int err = ccon->wqueue_error;
+    ccon->wqueue_error = 0;
+    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot write connection");
+  }
+#endif
+
+  return ScalarLogical(ccon->wqueue_head == NULL);
+}
+
+SEXP processx_connection_write_pending(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  const char *names[] = { "chunks", "bytes", "" };
+  SEXP result;
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+
+  result = PROTECT(mkNamed(REALSXP, names));
+  REAL(result)[0] = ccon->wqueue_chunks;
+  REAL(result)[1] = ccon->wqueue_bytes;
   UNPROTECT(1);
   return result;
 }
@@ -281,6 +513,44 @@ SEXP processx_connection_create_pipepair(SEXP encoding, SEXP nonblocking) {
   return result;
 }
 
+/* A plain pipe between two child processes. The first connection is the
+   readable end, the second is the writeable end. Both are blocking,
+   because they are meant to be inherited, and not read from R. */
+
+SEXP processx_connection_create_os_pipe(SEXP pipe_size) {
+  int c_pipe_size = asInteger(pipe_size);
+  SEXP result, con1, con2;
+
+#ifdef _WIN32
+  HANDLE h1, h2;
+  processx__create_pipe(0, &h1, &h2, "???");
+
+#else
+  int fds[2], h1, h2;
+  if (pipe(fds)) R_THROW_SYSTEM_ERROR("Cannot create pipe");
+  processx__cloexec_fcntl(fds[0], 1);
+  processx__cloexec_fcntl(fds[1], 1);
+#ifdef F_SETPIPE_SZ
+  /* This is just a hint, the kernel might not resize the pipe */
+  if (c_pipe_size > 0) fcntl(fds[1], F_SETPIPE_SZ, c_pipe_size);
+#endif
+  h1 = fds[0];
+  h2 = fds[1];
+#endif
+
+  processx_c_connection_create(h1, PROCESSX_FILE_TYPE_PIPE, "", &con1);
+  PROTECT(con1);
+  processx_c_connection_create(h2, PROCESSX_FILE_TYPE_PIPE, "", &con2);
+  PROTECT(con2);
+
+  result = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(result, 0, con1);
+  SET_VECTOR_ELT(result, 1, con2);
+
+  UNPROTECT(3);
+  return result;
+}
+
 SEXP processx__connection_set_std(SEXP con, int which, int drop) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   if (!ccon) R_THROW_ERROR("Invalid connection object");
@@ -419,6 +689,7 @@ processx_connection_t *processx_c_connection_create(
   con->is_eof_  = 0;
   con->is_eof_raw_ = 0;
   con->close_on_destroy = 1;
+  con->encoding_type = -1;
   con->iconv_ctx = 0;
 
   con->buffer = 0;
@@ -429,6 +700,19 @@ processx_connection_t *processx_c_connection_create(
   con->utf8_allocated_size = 0;
   con->utf8_data_size = 0;
 
+  con->binary = 0;
+  con->binary_incomplete = 0;
+
+  con->wqueue_head = con->wqueue_tail = NULL;
+  con->wqueue_chunks = 0;
+  con->wqueue_bytes = 0;
+  con->wqueue_error = 0;
+  con->no_send = 0;
+  con->wpending_next = NULL;
+  con->wpending = 0;
+  con->poller_item = NULL;
+  con->reader = NULL;
+
   con->encoding = 0;
   if (encoding && encoding[0]) {
     con->encoding = strdup(encoding);
@@ -466,10 +750,19 @@ void processx_c_connection_destroy(processx_connection_t *ccon) {
   if (!ccon) return;
 
   if (ccon->close_on_destroy) processx_c_connection_close(ccon);
+#ifndef _WIN32
+  /* The I/O thread must let go of it, even if it is not closed */
+  if (ccon->reader) processx__reader_stop(ccon);
+#endif
 
-  /* Even if not close_on_destroy, for us the connection is closed. */
+  /* Even if not close_on_destroy, for us the connection is closed.
+     Its unwritten data is dropped, and it must leave the pending list
+     before it is freed. */
+  processx__connection_wqueue_drop(ccon);
   ccon->is_closed_ = 1;
 
+  if (ccon->poller_item) processx__poller_forget(ccon);
+
 #ifdef _WIN32
   /* Check if we can free the connection. If there is a pending read,
      then we cannot. In this case schedule_destroy will add it to a free
@@ -548,6 +841,10 @@ ssize_t processx_c_connection_read_line(processx_connection_t *ccon,
 
   if (ccon->is_eof_) return -1;
 
+  if (ccon->binary) {
+    R_THROW_ERROR("cannot read line, connection is in binary mode");
+  }
+
   /* Read until a newline character shows up, or there is nothing more
      to read (at least for now). */
   newline = processx__connection_read_until_newline(ccon);
@@ -609,25 +906,27 @@ ssize_t processx_c_connection_write_bytes(
   if (!ret) R_THROW_SYSTEM_ERROR("Cannot write connection");
   return (ssize_t) written;
 #else
-  /* Need to ignore SIGPIPE here, otherwise R might crash */
-  struct sigaction old_handler, new_handler;
-  memset(&new_handler, 0, sizeof(new_handler));
-  sigemptyset(&new_handler.sa_mask);
-  new_handler.sa_handler = SIG_IGN;
-  sigaction(SIGPIPE, &new_handler, &old_handler );
-
-  ssize_t ret = write(ccon->handle, buffer, nbytes);
-  int err = errno;
+  struct iovec iov;
+  ssize_t ret;
 
-  sigaction(SIGPIPE, &old_handler, NULL );
+  if (ccon->wqueue_error) {
+    int err = ccon->wqueue_error;
+    ccon->wqueue_error = 0;
+    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot write connection");
+  }
 
-  if (ret == -1) {
-    if (err == EAGAIN || err == EWOULDBLOCK) {
-      return 0;
-    } else {
+  /* Queued data goes first */
+  if (ccon->wqueue_head) {
+    if (processx__connection_wqueue_drain(ccon)) {
       R_THROW_SYSTEM_ERROR("Cannot write connection");
     }
+    if (ccon->wqueue_head) return 0;
   }
+
+  iov.iov_base = (void*) buffer;
+  iov.iov_len = nbytes;
+  ret = processx__connection_writev(ccon, &iov, 1);
+  if (ret == -1) R_THROW_SYSTEM_ERROR("Cannot write connection");
   return ret;
 #endif
 }
@@ -637,8 +936,48 @@ int processx_c_connection_is_eof(processx_connection_t *ccon) {
   return ccon->is_eof_;
 }
 
+/* What we have in the buffers, plus what the OS has for us. For the raw
+   buffer this is not the number of UTF-8 bytes, but close enough. */
+double processx_c_connection_bytes_available(processx_connection_t *ccon) {
+  double bytes = ccon->buffer_data_size + ccon->utf8_data_size;
+
+  if (ccon->is_closed_) return bytes;
+
+#ifdef _WIN32
+  if (ccon->type == PROCESSX_FILE_TYPE_PIPE ||
+      ccon->type == PROCESSX_FILE_TYPE_ASYNCPIPE) {
+    DWORD avail = 0;
+    if (PeekNamedPipe(ccon->handle.handle, NULL, 0, NULL, &avail, NULL)) {
+      bytes += avail;
+    }
+  }
+#else
+  if (ccon->reader) {
+    bytes += processx__reader_bytes(ccon);
+  } else if (ccon->type == PROCESSX_FILE_TYPE_PIPE ||
+	     ccon->type == PROCESSX_FILE_TYPE_ASYNCPIPE) {
+    int avail = 0;
+    if (ioctl(ccon->handle, FIONREAD, &avail) == 0 && avail > 0) {
+      bytes += avail;
+    }
+  } else if (ccon->type == PROCESSX_FILE_TYPE_FILE) {
+    struct stat st;
+    off_t pos = lseek(ccon->handle, 0, SEEK_CUR);
+    if (pos >= 0 && fstat(ccon->handle, &st) == 0 && st.st_size > pos) {
+      bytes += st.st_size - pos;
+    }
+  }
+#endif
+
+  return bytes;
+}
+
 /* Close */
 void processx_c_connection_close(processx_connection_t *ccon) {
+  if (ccon->poller_item) processx__poller_closed(ccon);
+#ifndef _WIN32
+  if (ccon->reader) processx__reader_stop(ccon);
+#endif
 #ifdef _WIN32
   if (ccon->handle.handle) {
     CloseHandle(ccon->handle.handle);
@@ -648,6 +987,7 @@ void processx_c_connection_close(processx_connection_t *ccon) {
   if (ccon->handle >= 0) close(ccon->handle);
   ccon->handle = -1;
 #endif
+  processx__connection_wqueue_drop(ccon);
   ccon->is_closed_ = 1;
 }
 
@@ -937,7 +1277,7 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
     case PXHANDLE:
       el->event = PXSILENT;
       fds[j].fd = el->handle;
-      fds[j].events = POLLIN;
+      fds[j].events = el->write ? POLLOUT : POLLIN;
       fds[j].revents = 0;
       ptr[j] = (int) i;
       j++;
@@ -988,8 +1328,18 @@ int processx_c_connection_poll(processx_pollable_t pollables[],
           }
         }
       } else {
-        pollables[ptr[i]].event = processx__poll_decode(fds[i].revents);
-        hasdata += (pollables[ptr[i]].event == PXREADY);
+        processx_pollable_t *el = pollables + ptr[i];
+        el->event = processx__poll_decode(fds[i].revents);
+        /* Queued data goes first, we are only writable if it is out */
+        if (el->write && el->event == PXREADY) {
+          processx_connection_t *ccon = el->object;
+          if (ccon->wqueue_head && processx__connection_wqueue_drain(ccon)) {
+            ccon->wqueue_error = errno;
+            processx__connection_wqueue_drop(ccon);
+          }
+          if (ccon->wqueue_head) el->event = PXSILENT;
+        }
+        hasdata += (el->event == PXREADY);
       }
     }
   }
@@ -1012,6 +1362,12 @@ void processx__connection_start_read(processx_connection_t *ccon) {
 
   if (!ccon->buffer) processx__connection_alloc(ccon);
 
+  /* In binary mode the buffer might be full with an incomplete record */
+  if (ccon->binary &&
+      ccon->buffer_data_size == ccon->buffer_allocated_size) {
+    processx__connection_realloc_raw(ccon, 0);
+  }
+
   todo = ccon->buffer_allocated_size - ccon->buffer_data_size;
 
   res = processx__thread_readfile(
@@ -1057,12 +1413,21 @@ void processx__connection_start_read(processx_connection_t *ccon) {
  *    raw buffer has incomplete UTF8 characters.
  * 5. otherwise, if there is something in the raw buffer, we try
  *    to convert it to UTF8.
+ *
+ * In binary mode there is no UTF8 buffer, and we return PXREADY if the
+ * raw buffer has more data than the incomplete record or frame that
+ * was left there by the last read.
  */
 
 #define PROCESSX__I_PRE_POLL_FUNC_CONNECTION_READY do {			\
   if (!ccon) return PXNOPIPE;						\
   if (ccon->is_closed_) return PXCLOSED;				\
   if (ccon->is_eof_) return PXREADY;					\
+  if (ccon->binary) {							\
+    if (ccon->buffer_data_size > ccon->binary_incomplete) return PXREADY; \
+    if (ccon->buffer_data_size > 0 && ccon->is_eof_raw_) return PXREADY; \
+    break;								\
+  }									\
   if (ccon->utf8_data_size > 0) return PXREADY;				\
   if (ccon->buffer_data_size > 0 && ccon->is_eof_raw_) return PXREADY;	\
   if (ccon->buffer_data_size > 0) {					\
@@ -1082,6 +1447,21 @@ int processx_i_pre_poll_func_connection(processx_pollable_t *pollable) {
   PROCESSX__I_PRE_POLL_FUNC_CONNECTION_READY;
   pollable->handle = ccon->handle.overlapped.hEvent;
 #else
+  /* A poller might be reading into the buffer, so we cannot poll the
+     fd, only after picking up the data */
+  if (ccon->poller_item && processx__poller_pending(ccon)) {
+    processx__connection_read(ccon);
+    PROCESSX__I_PRE_POLL_FUNC_CONNECTION_READY;
+  }
+  /* The I/O thread reads the fd, we wait for its notification */
+  if (ccon->reader) {
+    if (processx__reader_pending(ccon)) {
+      processx__connection_read(ccon);
+      PROCESSX__I_PRE_POLL_FUNC_CONNECTION_READY;
+    }
+    pollable->handle = processx__reader_fd(ccon);
+    return PXHANDLE;
+  }
   pollable->handle = ccon->handle;
 #endif
 
@@ -1096,6 +1476,37 @@ int processx_c_pollable_from_connection(
   pollable->object = ccon;
   pollable->free = 0;
   pollable->fds = R_NilValue;
+  pollable->write = 0;
+  return 0;
+}
+
+/* Polling for writing. On Windows writes wait until the data is
+   written, so the connection is always ready. */
+
+int processx_i_pre_poll_func_connection_write(processx_pollable_t *pollable) {
+
+  processx_connection_t *ccon = pollable->object;
+
+  if (!ccon) return PXNOPIPE;
+  if (ccon->is_closed_) return PXCLOSED;
+
+#ifdef _WIN32
+  return PXREADY;
+#else
+  pollable->handle = ccon->handle;
+  return PXHANDLE;
+#endif
+}
+
+int processx_c_pollable_from_connection_write(
+  processx_pollable_t *pollable,
+  processx_connection_t *ccon) {
+
+  pollable->pre_poll_func = processx_i_pre_poll_func_connection_write;
+  pollable->object = ccon;
+  pollable->free = 0;
+  pollable->fds = R_NilValue;
+  pollable->write = 1;
   return 0;
 }
 
@@ -1111,6 +1522,7 @@ int processx_c_pollable_from_curl(
   pollable->object = NULL;
   pollable->free = 0;
   pollable->fds = fds;
+  pollable->write = 0;
   return 0;
 }
 
@@ -1136,7 +1548,9 @@ processx_file_handle_t processx_c_connection_fileno(
  * @param ccon Connection.
  * @param maxchars Maximum number of characters to find.
  * @param maxbytes Maximum number of bytes to check while searching.
- * @param chars Number of characters found is stored here.
+ * @param chars Number of characters found is stored here. If
+ *   `maxchars` is negative, then the characters are not counted, and
+ *   this is not set.
  * @param bytes Number of bytes the `chars` characters span.
  *
  */
@@ -1151,10 +1565,23 @@ static void processx__connection_find_chars(processx_connection_t *ccon,
 
   PROCESSX_CHECK_VALID_CONN(ccon);
 
+  if (ccon->binary) {
+    R_THROW_ERROR("Cannot read characters, connection is in binary mode");
+  }
+
   should_read_more = ! ccon->is_eof_ && ccon->utf8_data_size == 0;
   if (should_read_more) processx__connection_read(ccon);
 
-  if (ccon->utf8_data_size == 0 || maxchars == 0) { *bytes = 0; return; }
+  if (ccon->utf8_data_size == 0 || maxchars == 0 || maxbytes == 0) {
+    *bytes = 0;
+    return;
+  }
+
+  /* No need to count characters if we only have a byte budget */
+  if (maxchars < 0) {
+    *bytes = processx__connection_find_utf8_bytes(ccon, maxbytes);
+    return;
+  }
 
   /* At at most cnchars characters from the UTF8 buffer */
   processx__connection_find_utf8_chars(ccon, maxchars, maxbytes, chars,
@@ -1188,6 +1615,10 @@ static void processx__connection_find_lines(processx_connection_t *ccon,
 
   PROCESSX_CHECK_VALID_CONN(ccon);
 
+  if (ccon->binary) {
+    R_THROW_ERROR("Cannot read lines, connection is in binary mode");
+  }
+
   /* Read until a newline character shows up, or there is nothing more
      to read (at least for now). */
   newline = processx__connection_read_until_newline(ccon);
@@ -1208,6 +1639,145 @@ static void processx__connection_find_lines(processx_connection_t *ccon,
 
 }
 
+/**
+ * Find one or more delimited records in the raw buffer
+ *
+ * This puts the connection into binary mode. We read at most once if
+ * there is no complete record in the buffer, and we only grow the buffer
+ * if it is full, but does not contain a delimiter.
+ *
+ * @param ccon Connection.
+ * @param delim The delimiter byte.
+ * @param maxrecords Maximum number of records to find, -1 means all
+ *   available records.
+ * @param records Number of records found is stored here.
+ * @param bytes Number of bytes the records span, including the
+ *   delimiters.
+ * @param eof If the end of the file is reached, and there is no
+ *   delimiter at the end of the file, this is set to 1.
+ *
+ */
+
+static void processx__connection_find_records(processx_connection_t *ccon,
+					      int delim,
+					      ssize_t maxrecords,
+					      size_t *records,
+					      size_t *bytes,
+					      int *eof) {
+
+  /* There is no delimiter before this position */
+  size_t scan;
+
+  *records = *bytes = 0;
+  *eof = 0;
+
+  processx__connection_set_binary(ccon);
+  if (maxrecords == 0) return;
+
+  /* Only read if we surely don't have a full record already */
+  scan = ccon->binary_incomplete;
+  if (ccon->buffer_data_size == scan) processx__connection_read(ccon);
+
+  while (1) {
+    while (maxrecords < 0 || *records < maxrecords) {
+      char *ptr = memchr(ccon->buffer + scan, delim,
+			 ccon->buffer_data_size - scan);
+      if (!ptr) break;
+      (*records)++;
+      scan = *bytes = ptr - ccon->buffer + 1;
+    }
+    if (*records > 0 || ccon->is_eof_raw_) break;
+
+    /* Nothing yet, try to read more, in a bigger buffer if needed */
+    scan = ccon->buffer_data_size;
+#ifdef _WIN32
+    if (ccon->handle.read_pending) break;
+#endif
+    if (ccon->buffer_data_size == ccon->buffer_allocated_size) {
+      processx__connection_realloc_raw(ccon, 0);
+    }
+    if (processx__connection_read(ccon) == 0) break;
+  }
+
+  /* If there is no delimiter at the end of the file, we still add the
+     last record. */
+  if (ccon->is_eof_raw_ && (maxrecords < 0 || *records < maxrecords) &&
+      *bytes < ccon->buffer_data_size) {
+    *eof = 1;
+  }
+}
+
+/**
+ * Find one or more length prefixed frames in the raw buffer
+ *
+ * The frame header is an unsigned integer of `header_size` bytes, the
+ * number of bytes in the payload, that follows the header. If there is
+ * no complete frame in the buffer, then we keep reading until there is
+ * one, or there is no more data available without blocking. The buffer
+ * is grown to hold the first incomplete frame, so a frame cannot be
+ * larger than `max_frame_size`, otherwise a misbehaving peer could make
+ * us allocate any amount of memory.
+ *
+ * @param ccon Connection.
+ * @param header_size Size of the header, 1, 2, 4 or 8 bytes.
+ * @param big_endian Whether the header is big endian.
+ * @param maxframes Maximum number of frames to find, -1 means all
+ *   available frames.
+ * @param max_frame_size Maximum payload size, larger frames are an
+ *   error.
+ * @param frames Number of frames found is stored here.
+ * @param bytes Number of bytes the frames span, including the headers.
+ *
+ */
+
+static void processx__connection_find_frames(processx_connection_t *ccon,
+					     int header_size,
+					     int big_endian,
+					     ssize_t maxframes,
+					     size_t max_frame_size,
+					     size_t *frames,
+					     size_t *bytes) {
+
+  /* Number of bytes we need for the first incomplete frame */
+  size_t need = 0;
+
+  *frames = *bytes = 0;
+
+  processx__connection_set_binary(ccon);
+  if (maxframes == 0) return;
+
+  if (ccon->buffer_data_size == ccon->binary_incomplete) {
+    processx__connection_read(ccon);
+  }
+
+  while (1) {
+    while (maxframes < 0 || *frames < maxframes) {
+      size_t avail = ccon->buffer_data_size - *bytes;
+      size_t len;
+      if (avail < header_size) { need = header_size; break; }
+      len = processx__frame_length(ccon->buffer + *bytes, header_size,
+				   big_endian);
+      if (len > max_frame_size || len > (size_t) -1 - header_size) {
+	R_THROW_ERROR("Frame is too large, %zu bytes, the limit is %zu bytes",
+		      len, max_frame_size);
+      }
+      if (avail - header_size < len) { need = header_size + len; break; }
+      (*frames)++;
+      *bytes += header_size + len;
+    }
+    if (*frames > 0 || ccon->is_eof_raw_) break;
+
+    /* Nothing yet, try to read more, in a bigger buffer if needed */
+#ifdef _WIN32
+    if (ccon->handle.read_pending) break;
+#endif
+    if (need > ccon->buffer_allocated_size) {
+      processx__connection_realloc_raw(ccon, need);
+    }
+    if (processx__connection_read(ccon) == 0) break;
+  }
+}
+
 static void processx__connection_xfinalizer(SEXP con) {
   processx_connection_t *ccon = R_ExternalPtrAddr(con);
   processx_c_connection_destroy(ccon);
@@ -1296,6 +1866,129 @@ static void processx__connection_realloc(processx_connection_t *ccon) {
   ccon->utf8_allocated_size = new_size;
 }
 
+/* Grow the raw buffer, used in binary mode only, because in text mode
+   the raw buffer is transient. `need` is the minimum new size, or zero. */
+
+static void processx__connection_realloc_raw(processx_connection_t *ccon,
+					     size_t need) {
+  size_t new_size = ccon->buffer_allocated_size * 2;
+  void *nb;
+  if (new_size < need) new_size = need;
+  /* A poller might be reading into the buffer, see poller.c */
+  if (ccon->poller_item) processx__poller_release(ccon);
+  nb = realloc(ccon->buffer, new_size);
+  if (!nb) R_THROW_ERROR("Cannot allocate memory for processx buffer");
+  ccon->buffer = nb;
+  ccon->buffer_allocated_size = new_size;
+}
+
+/* Put the connection into binary mode. In binary mode the raw buffer is
+   not converted to UTF8, so we cannot switch if there is converted text
+   in the UTF8 buffer already. */
+
+static void processx__connection_set_binary(processx_connection_t *ccon) {
+  PROCESSX_CHECK_VALID_CONN(ccon);
+  if (ccon->binary) return;
+  if (ccon->utf8_data_size > 0) {
+    R_THROW_ERROR("Cannot switch to binary mode, connection has "
+		  "buffered text");
+  }
+  ccon->binary = 1;
+  ccon->binary_incomplete = 0;
+  if (!ccon->buffer) processx__connection_alloc(ccon);
+}
+
+/* Remove `bytes` bytes of records or frames from the raw buffer. If
+   `more` is zero then the rest of the buffer is an incomplete record or
+   frame, and we don't need to look at it again until we read more. */
+
+static void processx__connection_consume_raw(processx_connection_t *ccon,
+					     size_t bytes, int more) {
+  ccon->buffer_data_size -= bytes;
+  if (bytes > 0 && ccon->buffer_data_size > 0) {
+    memmove(ccon->buffer, ccon->buffer + bytes, ccon->buffer_data_size);
+  }
+  ccon->binary_incomplete = more ? 0 : ccon->buffer_data_size;
+  if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) ccon->is_eof_ = 1;
+}
+
+/* Move everything from the connection's buffer to the end of `buf`. In
+   text mode this is the UTF-8 buffer, which only has complete
+   characters, in binary mode the raw buffer. `buf` is grown to at least
+   double size if needed, so the caller must protect the returned
+   vector. */
+
+SEXP processx__connection_drain(processx_connection_t *ccon,
+				SEXP buf, R_xlen_t *size) {
+  char *data = ccon->binary ? ccon->buffer : ccon->utf8;
+  size_t *data_size =
+    ccon->binary ? &ccon->buffer_data_size : &ccon->utf8_data_size;
+  R_xlen_t len = *data_size;
+
+  if (len == 0) return buf;
+
+  if (*size + len > XLENGTH(buf)) {
+    R_xlen_t new_size = XLENGTH(buf) * 2;
+    SEXP nb;
+    if (new_size < *size + len) new_size = *size + len;
+    PROTECT(buf);
+    nb = allocVector(RAWSXP, new_size);
+    memcpy(RAW(nb), RAW(buf), *size);
+    UNPROTECT(1);
+    buf = nb;
+  }
+
+  memcpy(RAW(buf) + *size, data, len);
+  *size += len;
+  *data_size = 0;
+  if (ccon->binary) ccon->binary_incomplete = 0;
+
+  return buf;
+}
+
+/* Split UTF-8 text into lines, the same way as read_lines() does */
+
+static SEXP processx__split_lines(const char *data, R_xlen_t size) {
+  const char *ptr = data, *end = data + size, *nl;
+  R_xlen_t nlines = 0, l;
+  SEXP result;
+
+  while (ptr < end && (nl = memchr(ptr, '\n', end - ptr))) {
+    nlines++;
+    ptr = nl + 1;
+  }
+  if (ptr < end) nlines++;
+
+  result = PROTECT(allocVector(STRSXP, nlines));
+  for (l = 0, ptr = data; l < nlines; l++) {
+    R_xlen_t len;
+    nl = memchr(ptr, '\n', end - ptr);
+    len = (nl ? nl : end) - ptr;
+    if (nl && len > 0 && ptr[len - 1] == '\r') len--;
+    if (len > INT_MAX) R_THROW_ERROR("Line is too long");
+    SET_STRING_ELT(result, l, mkCharLenCE(ptr, (int) len, CE_UTF8));
+    ptr = nl ? nl + 1 : end;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Decode an unsigned frame header */
+
+static size_t processx__frame_length(const char *header, int header_size,
+				     int big_endian) {
+  const unsigned char *h = (const unsigned char*) header;
+  size_t len = 0;
+  int i;
+  if (big_endian) {
+    for (i = 0; i < header_size; i++) len = (len << 8) | h[i];
+  } else {
+    for (i = header_size - 1; i >= 0; i--) len = (len << 8) | h[i];
+  }
+  return len;
+}
+
 /* Read as much as we can. This is the only function that explicitly
    works with the raw buffer. It is also the only function that actually
    reads from the data source.
@@ -1308,6 +2001,9 @@ static void processx__connection_realloc(processx_connection_t *ccon) {
 ssize_t processx__connection_read(processx_connection_t *ccon) {
   DWORD todo, bytes_read = 0;
 
+  /* We might buffer data, that the poller needs to know about */
+  if (ccon->poller_item) processx__poller_touch(ccon);
+
   /* Nothing to read, nothing to convert to UTF8 */
   if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
     if (ccon->utf8_data_size == 0) ccon->is_eof_ = 1;
@@ -1336,7 +2032,7 @@ ssize_t processx__connection_read(processx_connection_t *ccon) {
 	processx_connection_t *con = (processx_connection_t *) key;
 	con->handle.read_pending = FALSE;
 	con->buffer_data_size += bytes;
-	if (con->buffer && con->buffer_data_size > 0) {
+	if (con->buffer && con->buffer_data_size > 0 && !con->binary) {
 	  bytes = processx__connection_to_utf8(con);
 	}
 	if (con->type == PROCESSX_FILE_TYPE_ASYNCFILE) {
@@ -1371,8 +2067,12 @@ ssize_t processx__connection_read(processx_connection_t *ccon) {
 
 #else
 
-static ssize_t processx__connection_read(processx_connection_t *ccon) {
-  ssize_t todo, bytes_read;
+ssize_t processx__connection_read(processx_connection_t *ccon) {
+  ssize_t todo, bytes_read, staged = -1;
+
+  /* We might buffer data, that the poller needs to know about. The
+     poller might have also read for us already, see poller.c */
+  if (ccon->poller_item) staged = processx__poller_touch(ccon);
 
   /* Nothing to read, nothing to convert to UTF8 */
   if (ccon->is_eof_raw_ && ccon->buffer_data_size == 0) {
@@ -1380,6 +2080,19 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
     return 0;
   }
 
+  /* A pidfd has no data, it is at EOF once the process has exited */
+  if (ccon->type == PROCESSX_FILE_TYPE_PIDFD) {
+    struct pollfd fd;
+    fd.fd = ccon->handle;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    if (poll(&fd, 1, 0) > 0) {
+      ccon->is_eof_raw_ = 1;
+      if (ccon->utf8_data_size == 0) ccon->is_eof_ = 1;
+    }
+    return 0;
+  }
+
   if (!ccon->buffer) processx__connection_alloc(ccon);
 
   /* If cannot read anything more, then try to convert to UTF8 */
@@ -1387,7 +2100,15 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
   if (todo == 0) return processx__connection_to_utf8(ccon);
 
   /* Otherwise we read */
-  bytes_read = read(ccon->handle, ccon->buffer + ccon->buffer_data_size, todo);
+  if (staged >= 0) {
+    bytes_read = staged;
+  } else if (ccon->reader) {
+    bytes_read = processx__reader_read(
+      ccon, ccon->buffer + ccon->buffer_data_size, todo);
+  } else {
+    bytes_read = read(ccon->handle, ccon->buffer + ccon->buffer_data_size,
+		      todo);
+  }
 
   if (bytes_read == 0) {
     /* EOF */
@@ -1407,6 +2128,9 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
 
   ccon->buffer_data_size += bytes_read;
 
+  /* In binary mode there is nothing to convert */
+  if (ccon->binary) return bytes_read;
+
   /* If there is anything to convert to UTF8, try converting */
   if (ccon->buffer_data_size > 0) {
     bytes_read = processx__connection_to_utf8(ccon);
@@ -1418,6 +2142,212 @@ static ssize_t processx__connection_read(processx_connection_t *ccon) {
 }
 #endif
 
+/* Built-in converters to UTF-8
+ *
+ * Most programs write UTF-8, latin1 or CP1252, and we do not need iconv
+ * for these. UTF-8 input is only validated, and the valid parts are
+ * copied in bulk. ASCII runs are checked eight bytes at a time. Invalid
+ * bytes are dropped, just like in the iconv converter, but a whole run of
+ * them is dropped at once, without restarting the conversion after each
+ * one.
+ */
+
+#define PROCESSX__ENC_ICONV  0
+#define PROCESSX__ENC_UTF8   1
+#define PROCESSX__ENC_LATIN1 2
+#define PROCESSX__ENC_CP1252 3
+
+static int processx__encoding_type(const char *encoding) {
+  char norm[32];
+  size_t i, j;
+
+#ifndef _WIN32
+  if (!encoding[0]) encoding = nl_langinfo(CODESET);
+#endif
+
+  for (i = 0, j = 0; encoding[i] && j < sizeof(norm) - 1; i++) {
+    char c = encoding[i];
+    if (c == '-' || c == '_') continue;
+    norm[j++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+  }
+  norm[j] = '\0';
+
+  if (!strcmp(norm, "utf8")) return PROCESSX__ENC_UTF8;
+  if (!strcmp(norm, "latin1") || !strcmp(norm, "iso88591")) {
+    return PROCESSX__ENC_LATIN1;
+  }
+  if (!strcmp(norm, "cp1252") || !strcmp(norm, "windows1252")) {
+    return PROCESSX__ENC_CP1252;
+  }
+  return PROCESSX__ENC_ICONV;
+}
+
+/* 0x80 - 0x9f in CP1252, zero means undefined */
+static const unsigned short processx__cp1252[32] = {
+  0x20ac, 0,      0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+  0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0,      0x017d, 0,
+  0,      0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+  0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0,      0x017e, 0x0178 };
+
+/* Length of the ASCII prefix of `p`, at most `n` */
+
+static size_t processx__ascii_run(const unsigned char *p, size_t n) {
+  size_t i = 0;
+  while (i + 8 <= n) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    if (w & UINT64_C(0x8080808080808080)) break;
+    i += 8;
+  }
+  while (i < n && p[i] < 0x80) i++;
+  return i;
+}
+
+/* Length of the valid UTF-8 character at `p`, that is not ASCII.
+   Zero if it is invalid, -1 if it is incomplete, i.e. valid so far,
+   but `n` bytes are not enough. */
+
+static int processx__utf8_valid(const unsigned char *p, size_t n) {
+  int len, i;
+  unsigned char lo = 0x80, hi = 0xbf;
+  unsigned char c = p[0];
+
+  if (c >= 0xc2 && c <= 0xdf) {
+    len = 2;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    len = 3;
+    if (c == 0xe0) lo = 0xa0;
+    if (c == 0xed) hi = 0x9f;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    len = 4;
+    if (c == 0xf0) lo = 0x90;
+    if (c == 0xf4) hi = 0x8f;
+  } else {
+    return 0;
+  }
+
+  for (i = 1; i < len; i++) {
+    if (i == n) return -1;
+    if (p[i] < lo || p[i] > hi) return 0;
+    lo = 0x80; hi = 0xbf;
+  }
+
+  return len;
+}
+
+/* Length of the run of invalid bytes at `p`, at most `n`. Continuation
+   bytes and bytes that never start a character are skipped without
+   validation, only the possible lead bytes need a closer look. An
+   incomplete character at the end of the buffer is not part of the
+   run. */
+
+static size_t processx__utf8_invalid_run(const unsigned char *p,
+					 size_t n) {
+  size_t i = 0;
+  while (i < n && p[i] >= 0x80) {
+    unsigned char c = p[i];
+    if (c >= 0xc2 && c <= 0xf4 && processx__utf8_valid(p + i, n - i) != 0) {
+      break;
+    }
+    i++;
+  }
+  return i;
+}
+
+static ssize_t processx__connection_to_utf8_fast(processx_connection_t *ccon) {
+  const unsigned char *in = (const unsigned char*) ccon->buffer;
+  const unsigned char *end = in + ccon->buffer_data_size;
+  char *out = ccon->utf8 + ccon->utf8_data_size;
+  char *outend = ccon->utf8 + ccon->utf8_allocated_size;
+  char *outstart = out;
+  size_t indone;
+
+  if (ccon->encoding_type == PROCESSX__ENC_UTF8) {
+    /* Valid characters are copied in runs, there is at most one byte
+       of output for each byte of input. */
+    const unsigned char *run = in;
+    const unsigned char *lim = in + (end - in < outend - out ?
+				     end - in : outend - out);
+    while (in < lim) {
+      int len;
+      if (*in < 0x80) {
+	in += processx__ascii_run(in, lim - in);
+	continue;
+      }
+      len = processx__utf8_valid(in, end - in);
+      if (len > 0) {
+	if (in + len > lim) break;
+	in += len;
+	continue;
+      }
+      memcpy(out, run, in - run);
+      out += in - run;
+      if (len == 0) {
+	/* Invalid bytes, drop the whole run of them */
+	size_t bad = processx__utf8_invalid_run(in, end - in);
+	in += bad;
+	lim = end - lim < bad ? end : lim + bad;
+      } else {
+	/* Incomplete character, we'll handle it later, unless at the end */
+	if (ccon->is_eof_raw_) {
+	  warning("Invalid multi-byte character at end of stream ignored");
+	  in = end;
+	}
+	run = in;
+	break;
+      }
+      run = in;
+    }
+    memcpy(out, run, in - run);
+    out += in - run;
+
+  } else {
+    /* latin1 or CP1252, at most three bytes of output for each byte */
+    while (in < end && out < outend) {
+      unsigned int cp;
+      if (*in < 0x80) {
+	size_t n = end - in < outend - out ? end - in : outend - out;
+	n = processx__ascii_run(in, n);
+	memcpy(out, in, n);
+	in += n;
+	out += n;
+	continue;
+      }
+      cp = *in;
+      if (ccon->encoding_type == PROCESSX__ENC_CP1252 && cp < 0xa0) {
+	cp = processx__cp1252[cp - 0x80];
+	if (cp == 0) {
+	  /* Undefined in CP1252, drop it, and the ones after it */
+	  do in++; while (in < end && *in >= 0x80 && *in < 0xa0 &&
+			  processx__cp1252[*in - 0x80] == 0);
+	  continue;
+	}
+      }
+      if (cp < 0x800) {
+	if (outend - out < 2) break;
+	*out++ = (char) (0xc0 | (cp >> 6));
+	*out++ = (char) (0x80 | (cp & 0x3f));
+      } else {
+	if (outend - out < 3) break;
+	*out++ = (char) (0xe0 | (cp >> 12));
+	*out++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+	*out++ = (char) (0x80 | (cp & 0x3f));
+      }
+      in++;
+    }
+  }
+
+  /* Update the buffers, like for iconv */
+  indone = (const char*) in - ccon->buffer;
+  if (indone > 0 || out > outstart) {
+    ccon->buffer_data_size -= indone;
+    memmove(ccon->buffer, ccon->buffer + indone, ccon->buffer_data_size);
+    ccon->utf8_data_size += out - outstart;
+  }
+
+  return out - outstart;
+}
+
 static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
 
   const char *inbuf, *inbufold;
@@ -1429,6 +2359,17 @@ static ssize_t processx__connection_to_utf8(processx_connection_t *ccon) {
   const char *emptystr = "";
   const char *encoding = ccon->encoding ? ccon->encoding : emptystr;
 
+  /* Binary connections are never converted */
+  if (ccon->binary) return 0;
+
+  /* UTF-8, latin1 and CP1252 do not need iconv */
+  if (ccon->encoding_type < 0) {
+    ccon->encoding_type = processx__encoding_type(encoding);
+  }
+  if (ccon->encoding_type != PROCESSX__ENC_ICONV) {
+    return processx__connection_to_utf8_fast(ccon);
+  }
+
   inbuf = inbufold = ccon->buffer;
   outbuf = outbufold = ccon->utf8 + ccon->utf8_data_size;
 
@@ -1530,16 +2471,353 @@ static void processx__connection_find_utf8_chars(processx_connection_t *ccon,
   R_THROW_ERROR("Invalid UTF-8 string, internal error");
 }
 
+/* Number of bytes to take from the UTF8 buffer, at most `maxbytes`, or
+ * all of it if `maxbytes` is negative. The buffer only has complete
+ * characters, so we only need to step back from the end to the start of
+ * the last character, at most three bytes. If the first character does
+ * not fit, we return it anyway, otherwise the caller would never make
+ * progress. (The C API always asks for at least four bytes.) */
+
+static size_t processx__connection_find_utf8_bytes(processx_connection_t *ccon,
+						   ssize_t maxbytes) {
+  const unsigned char *utf8 = (const unsigned char *) ccon->utf8;
+  size_t n = ccon->utf8_data_size;
+
+  if (maxbytes < 0 || n <= (size_t) maxbytes) return n;
+
+  n = maxbytes;
+  while (n > 0 && (utf8[n] & 0xc0) == 0x80) n--;
+
+  if (n == 0) {
+    n = utf8[0] < 0x80 ? 1 : processx__utf8_length[utf8[0] & 0x3f];
+    if (n > ccon->utf8_data_size) {
+      R_THROW_ERROR("Invalid UTF-8 string, internal error");
+    }
+  }
+
+  return n;
+}
+
+/* Write queues
+ *
+ * Every connection has a queue of data that is waiting to be written.
+ * Connections with a non-empty queue are on the `processx__wpending`
+ * list, and `processx__poll()` adds them to every `poll()`, with
+ * POLLOUT, and writes as much of them as possible, when they are ready.
+ */
+
+static processx_connection_t *processx__wpending = NULL;
+
+static void processx__connection_wqueue_drop(processx_connection_t *ccon) {
+  processx_wchunk_t *chunk = ccon->wqueue_head;
+  while (chunk) {
+    processx_wchunk_t *next = chunk->next;
+    if (chunk->data != R_NilValue) R_ReleaseObject(chunk->data);
+    free(chunk);
+    chunk = next;
+  }
+  ccon->wqueue_head = ccon->wqueue_tail = NULL;
+  ccon->wqueue_chunks = 0;
+  ccon->wqueue_bytes = 0;
+
+  if (ccon->wpending) {
+    processx_connection_t **prev = &processx__wpending;
+    while (*prev != ccon) prev = &(*prev)->wpending_next;
+    *prev = ccon->wpending_next;
+    ccon->wpending_next = NULL;
+    ccon->wpending = 0;
+  }
+}
+
 #ifndef _WIN32
 
-int processx__interruptible_poll(struct pollfd fds[],
+static double processx__timestamp(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/* Small chunks are copied, for large ones we keep a reference to the R
+   raw vector, to avoid copying it. */
+
+#define PROCESSX__WQUEUE_COPY (64 * 1024)
+
+static void processx__connection_wqueue_push(processx_connection_t *ccon,
+					     SEXP bytes, size_t offset) {
+  size_t size = XLENGTH(bytes) - offset;
+  int copy = size < PROCESSX__WQUEUE_COPY;
+  processx_wchunk_t *chunk =
+    malloc(sizeof(processx_wchunk_t) + (copy ? size : 0));
+  if (!chunk) R_THROW_ERROR("Cannot queue data for writing, out of memory");
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->offset = 0;
+  if (copy) {
+    chunk->data = R_NilValue;
+    chunk->ptr = (const char*) (chunk + 1);
+    memcpy(chunk + 1, RAW(bytes) + offset, size);
+  } else {
+    R_PreserveObject(bytes);
+    chunk->data = bytes;
+    chunk->ptr = (const char*) RAW(bytes) + offset;
+  }
+
+  if (ccon->wqueue_tail) {
+    ccon->wqueue_tail->next = chunk;
+  } else {
+    ccon->wqueue_head = chunk;
+  }
+  ccon->wqueue_tail = chunk;
+  ccon->wqueue_chunks++;
+  ccon->wqueue_bytes += size;
+
+  if (!ccon->wpending) {
+    ccon->wpending_next = processx__wpending;
+    processx__wpending = ccon;
+    ccon->wpending = 1;
+  }
+}
+
+/* Write as much of the queue as we can, without blocking. This does not
+   throw errors, so it is safe to call from `processx__poll()`. Returns
+   -1 on error, with `errno` set. */
+
+#define PROCESSX__WQUEUE_IOV 64
+
+static int processx__connection_wqueue_drain(processx_connection_t *ccon) {
+  struct iovec iov[PROCESSX__WQUEUE_IOV];
+
+  while (ccon->wqueue_head) {
+    processx_wchunk_t *chunk = ccon->wqueue_head;
+    int n = 0;
+    ssize_t ret;
+
+    for (; chunk && n < PROCESSX__WQUEUE_IOV; chunk = chunk->next, n++) {
+      iov[n].iov_base = (void*) (chunk->ptr + chunk->offset);
+      iov[n].iov_len = chunk->size - chunk->offset;
+    }
+
+    ret = processx__connection_writev(ccon, iov, n);
+    if (ret == -1) return -1;
+    if (ret == 0) break;
+
+    ccon->wqueue_bytes -= ret;
+    while (ret > 0) {
+      size_t left;
+      chunk = ccon->wqueue_head;
+      left = chunk->size - chunk->offset;
+      if ((size_t) ret < left) {
+	chunk->offset += ret;
+	break;
+      }
+      ret -= left;
+      ccon->wqueue_head = chunk->next;
+      ccon->wqueue_chunks--;
+      if (chunk->data != R_NilValue) R_ReleaseObject(chunk->data);
+      free(chunk);
+    }
+    if (!ccon->wqueue_head) ccon->wqueue_tail = NULL;
+  }
+
+  if (!ccon->wqueue_head) processx__connection_wqueue_drop(ccon);
+  return 0;
+}
+
+/* Our pipes are socket pairs, so we can use `sendmsg()` with
+   MSG_NOSIGNAL, and we don't need to ignore SIGPIPE. For other file
+   types we fall back to `writev()`. Returns 0 if the write would block,
+   -1 on error. */
+
+static ssize_t processx__connection_writev(processx_connection_t *ccon,
+					   struct iovec *iov, int iovcnt) {
+  ssize_t ret;
+
+#ifdef MSG_NOSIGNAL
+  if (!ccon->no_send) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    do {
+      ret = sendmsg(ccon->handle, &msg, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+    if (ret != -1 || errno != ENOTSOCK) goto done;
+    ccon->no_send = 1;
+  }
+#endif
+
+  {
+    /* Need to ignore SIGPIPE here, otherwise R might crash */
+    struct sigaction old_handler, new_handler;
+    int err;
+    memset(&new_handler, 0, sizeof(new_handler));
+    sigemptyset(&new_handler.sa_mask);
+    new_handler.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &new_handler, &old_handler );
+
+    do {
+      ret = writev(ccon->handle, iov, iovcnt);
+    } while (ret == -1 && errno == EINTR);
+    err = errno;
+
+    sigaction(SIGPIPE, &old_handler, NULL );
+    errno = err;
+  }
+
+#ifdef MSG_NOSIGNAL
+ done:
+#endif
+  if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  return ret;
+}
+
+/* `poll()` that also writes the queued data of all connections. It
+   only returns if one of `fds` is ready, or on timeout or error. If a
+   queued write fails, the queue of that connection is dropped, and the
+   error is reported at the next write. */
+
+int processx__poll(struct pollfd fds[], nfds_t nfds, int timeout) {
+  struct pollfd *all;
+  processx_connection_t *ccon, *next;
+  double deadline = processx__timestamp() + timeout;
+  nfds_t i, n, npending = 0;
+  int ret, err;
+
+  for (ccon = processx__wpending; ccon; ccon = ccon->wpending_next) {
+    npending++;
+  }
+  if (npending == 0) return poll(fds, nfds, timeout);
+
+  all = malloc((nfds + npending) * sizeof(struct pollfd));
+  if (!all) return poll(fds, nfds, timeout);
+  if (nfds > 0) memcpy(all, fds, nfds * sizeof(struct pollfd));
+
+  while (1) {
+    n = nfds;
+    for (ccon = processx__wpending; ccon; ccon = ccon->wpending_next) {
+      all[n].fd = ccon->handle;
+      all[n].events = POLLOUT;
+      all[n].revents = 0;
+      n++;
+    }
+
+    ret = poll(all, n, timeout);
+    if (ret <= 0) break;
+
+    /* The list does not change between setting up `all` and here */
+    for (i = nfds, ccon = processx__wpending; i < n; i++, ccon = next) {
+      next = ccon->wpending_next;
+      if (all[i].revents == 0) continue;
+      if (processx__connection_wqueue_drain(ccon)) {
+	ccon->wqueue_error = errno;
+	processx__connection_wqueue_drop(ccon);
+      }
+    }
+
+    ret = 0;
+    for (i = 0; i < nfds; i++) if (all[i].revents) ret++;
+    if (ret > 0) break;
+
+    if (timeout >= 0) {
+      timeout = (int) (deadline - processx__timestamp());
+      if (timeout <= 0) {
+	ret = 0;
+	break;
+      }
+    }
+
+    /* All queues written, only the original fds are left */
+    if (!processx__wpending) {
+      ret = poll(all, nfds, timeout);
+      break;
+    }
+  }
+
+  err = errno;
+  for (i = 0; i < nfds; i++) fds[i].revents = all[i].revents;
+  free(all);
+  errno = err;
+  return ret;
+}
+
+/* Interrupts
+ *
+ * While we are waiting in `poll()`, SIGINT also writes to a self-pipe,
+ * that is in the poll set. So we can sleep for the whole timeout, and
+ * still react to an interrupt right away. Our handler calls R's handler
+ * as well, that sets the pending interrupt flag, and then we call
+ * `R_CheckUserInterrupt()`.
+ *
+ * The handler is only installed for the duration of the poll, and only
+ * if SIGINT has a handler already. If not, or if interrupts might come
+ * without a signal, e.g. in RStudio, then we wake up regularly, and
+ * check for interrupts.
+ */
+
+static int processx__intr_pipe[2] = { -1, -1 };
+static struct sigaction processx__intr_old;
+
+static void processx__intr_handler(int sig, siginfo_t *info, void *ctx) {
+  int saved_errno = errno;
+  if (write(processx__intr_pipe[1], "x", 1) == -1) { /* full, fine */ }
+  if (processx__intr_old.sa_flags & SA_SIGINFO) {
+    processx__intr_old.sa_sigaction(sig, info, ctx);
+  } else {
+    processx__intr_old.sa_handler(sig);
+  }
+  errno = saved_errno;
+}
+
+static int processx__intr_arm(void) {
+  static int usable = -1;
+  struct sigaction action;
+
+  if (usable == -1) {
+    const char *rs = getenv("RSTUDIO");
+    usable = !(rs && !strcmp(rs, "1"));
+    if (usable && pipe(processx__intr_pipe) == 0) {
+      processx__nonblock_fcntl(processx__intr_pipe[0], 1);
+      processx__nonblock_fcntl(processx__intr_pipe[1], 1);
+      processx__cloexec_fcntl(processx__intr_pipe[0], 1);
+      processx__cloexec_fcntl(processx__intr_pipe[1], 1);
+    } else {
+      usable = 0;
+    }
+  }
+  if (!usable) return 0;
+
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_sigaction = processx__intr_handler;
+  action.sa_flags = SA_SIGINFO;
+  if (sigaction(SIGINT, &action, &processx__intr_old)) return 0;
+
+  /* Only if there is a handler to call */
+  if (!(processx__intr_old.sa_flags & SA_SIGINFO) &&
+      (processx__intr_old.sa_handler == SIG_DFL ||
+       processx__intr_old.sa_handler == SIG_IGN)) {
+    sigaction(SIGINT, &processx__intr_old, NULL);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void processx__intr_disarm(void) {
+  char buf[64];
+  sigaction(SIGINT, &processx__intr_old, NULL);
+  while (read(processx__intr_pipe[0], buf, sizeof(buf)) > 0) ;
+}
+
+static int processx__sliced_poll(struct pollfd fds[],
 				 nfds_t nfds, int timeout) {
   int ret = 0;
   int timeleft = timeout;
 
   while (timeout < 0 || timeleft > PROCESSX_INTERRUPT_INTERVAL) {
     do {
-      ret = poll(fds, nfds, PROCESSX_INTERRUPT_INTERVAL);
+      ret = processx__poll(fds, nfds, PROCESSX_INTERRUPT_INTERVAL);
     } while (ret == -1 && errno == EINTR);
 
     /* If not a timeout, then return */
@@ -1552,10 +2830,73 @@ int processx__interruptible_poll(struct pollfd fds[],
   /* Maybe we are not done, and there is a little left from the timeout */
   if (timeleft >= 0) {
     do {
-      ret = poll(fds, nfds, timeleft);
+      ret = processx__poll(fds, nfds, timeleft);
+    } while (ret == -1 && errno == EINTR);
+  }
+
+  return ret;
+}
+
+int processx__interruptible_poll(struct pollfd fds[],
+				 nfds_t nfds, int timeout) {
+  struct pollfd *all;
+  double deadline = processx__timestamp() + timeout;
+  int ret, err, intr;
+  nfds_t i;
+
+  if (timeout == 0) {
+    do {
+      ret = processx__poll(fds, nfds, 0);
     } while (ret == -1 && errno == EINTR);
+    return ret;
+  }
+
+  all = malloc((nfds + 1) * sizeof(struct pollfd));
+  if (!all) return processx__sliced_poll(fds, nfds, timeout);
+  if (!processx__intr_arm()) {
+    free(all);
+    return processx__sliced_poll(fds, nfds, timeout);
+  }
+
+  if (nfds > 0) memcpy(all, fds, nfds * sizeof(struct pollfd));
+  all[nfds].fd = processx__intr_pipe[0];
+  all[nfds].events = POLLIN;
+
+  while (1) {
+    all[nfds].revents = 0;
+    ret = processx__poll(all, nfds + 1, timeout);
+    if (ret == -1 && errno == EINTR) {
+      if (timeout > 0) {
+	timeout = (int) (deadline - processx__timestamp());
+	if (timeout < 0) timeout = 0;
+      }
+      continue;
+    }
+    break;
+  }
+
+  err = errno;
+  intr = ret > 0 && all[nfds].revents != 0;
+  if (ret > 0) {
+    if (intr) ret--;
+    for (i = 0; i < nfds; i++) fds[i].revents = all[i].revents;
+  }
+  processx__intr_disarm();
+  free(all);
+
+  if (intr) {
+    /* This does not return, unless interrupts are suspended */
+    R_CheckUserInterrupt();
+    if (ret == 0) {
+      if (timeout > 0) {
+	timeout = (int) (deadline - processx__timestamp());
+	if (timeout <= 0) return 0;
+      }
+      return processx__interruptible_poll(fds, nfds, timeout);
+    }
   }
 
+  errno = err;
   return ret;
 }
 
@@ -50,9 +50,24 @@ typedef enum {
   PROCESSX_FILE_TYPE_FILE = 1,	/* regular file, blocking IO */
   PROCESSX_FILE_TYPE_ASYNCFILE,	/* regular file, async IO (well, win only) */
   PROCESSX_FILE_TYPE_PIPE,	/* pipe, blocking IO */
-  PROCESSX_FILE_TYPE_ASYNCPIPE	/* pipe, async IO */
+  PROCESSX_FILE_TYPE_ASYNCPIPE,	/* pipe, async IO */
+  PROCESSX_FILE_TYPE_PIDFD	/* pidfd, readable at exit (Linux only) */
 } processx_file_type_t;
 
+/* Data that is queued for writing. Small chunks are copied, large ones
+   point into an R raw vector, which is protected while it is in the
+   queue. */
+
+typedef struct processx_wchunk_s {
+  struct processx_wchunk_s *next;
+  SEXP data;			/* R_NilValue if copied */
+  const char *ptr;
+  size_t size;
+  size_t offset;		/* bytes already written */
+} processx_wchunk_t;
+
+typedef struct processx_reader_s processx_reader_t;
+
 typedef struct processx_connection_s {
   processx_file_type_t type;
 
@@ -62,6 +77,7 @@ typedef struct processx_connection_s {
   int close_on_destroy;
 
   char *encoding;
+  int encoding_type;		/* built-in converter, or iconv */
   void *iconv_ctx;
 
   processx_i_connection_t handle;
@@ -74,7 +90,21 @@ typedef struct processx_connection_s {
   size_t utf8_allocated_size;
   size_t utf8_data_size;
 
+  int binary;			/* records/frames, no UTF-8 conversion */
+  size_t binary_incomplete;	/* raw bytes known to be incomplete */
+
+  processx_wchunk_t *wqueue_head; /* data waiting to be written */
+  processx_wchunk_t *wqueue_tail;
+  size_t wqueue_chunks;
+  double wqueue_bytes;
+  int wqueue_error;		/* errno of a failed queued write */
+  int no_send;			/* not a socket, need write() */
+  struct processx_connection_s *wpending_next; /* list of queued writers */
+  int wpending;
+
   int poll_idx;
+  struct processx_poller_item_s *poller_item; /* if in a poller */
+  processx_reader_t *reader;	/* if read by the I/O thread */
 } processx_connection_t;
 
 struct processx_pollable_s;
@@ -111,6 +141,8 @@ typedef int (*processx_connection_pre_poll_func_t)(
  *   `PXSILENT` (no data), `PXREADY` (data), `PXTIMEOUT` (timeout).
  * @member fd If the pollable is an fd, then it is stored here instead of
  *   in `object`, for simplicity.
+ * @member write Whether a `PXHANDLE` is polled for writing, instead of
+ *   reading.
  */
 
 typedef struct processx_pollable_s {
@@ -120,6 +152,7 @@ typedef struct processx_pollable_s {
   int event;
   processx_file_handle_t handle;
   SEXP fds;
+  int write;
 } processx_pollable_t;
 
 /* --------------------------------------------------------------------- */
@@ -136,14 +169,31 @@ SEXP processx_connection_create_fd(SEXP handle, SEXP encoding, SEXP close);
 SEXP processx_connection_create_file(SEXP filename, SEXP read, SEXP write);
 
 /* Read characters in a given encoding from the connection. */
-SEXP processx_connection_read_chars(SEXP con, SEXP nchars);
+SEXP processx_connection_read_chars(SEXP con, SEXP nchars, SEXP nbytes);
 
 /* Read lines of characters from the connection. */
 SEXP processx_connection_read_lines(SEXP con, SEXP nlines);
 
+/* Read delimited binary records from the connection. */
+SEXP processx_connection_read_records(SEXP con, SEXP delim, SEXP nrecords);
+
+/* Read length-prefixed binary frames from the connection. */
+SEXP processx_connection_read_frames(SEXP con, SEXP header_size,
+				     SEXP big_endian, SEXP nframes,
+				     SEXP max_frame_size);
+
+/* Read everything until the end of the file. */
+SEXP processx_connection_read_all(SEXP con, SEXP type);
+
 /* Write characters */
 SEXP processx_connection_write_bytes(SEXP con, SEXP chars);
 
+/* Wait until the queued data is written. */
+SEXP processx_connection_flush(SEXP con, SEXP timeout);
+
+/* Number of chunks and bytes in the write queue. */
+SEXP processx_connection_write_pending(SEXP con);
+
 /* Check if the connection has ended. */
 SEXP processx_connection_is_eof(SEXP con);
 
@@ -157,6 +207,9 @@ SEXP processx_connection_poll(SEXP pollables, SEXP timeout);
 /* Functions for connection inheritance */
 SEXP processx_connection_create_pipepair();
 
+/* Create a pipe to connect two child processes */
+SEXP processx_connection_create_os_pipe(SEXP pipe_size);
+
 SEXP processx_connection_set_stdout(SEXP con, SEXP drop);
 
 SEXP processx_connection_set_stderr(SEXP con, SEXP drop);
@@ -203,6 +256,10 @@ ssize_t processx_c_connection_write_bytes(
 int processx_c_connection_is_eof(
   processx_connection_t *con);
 
+/* Number of bytes that can be read without waiting, an estimate */
+double processx_c_connection_bytes_available(
+  processx_connection_t *con);
+
 /* Close */
 void processx_c_connection_close(
   processx_connection_t *con);
@@ -219,6 +276,10 @@ int processx_c_pollable_from_connection(
   processx_pollable_t *pollable,
   processx_connection_t *ccon);
 
+int processx_c_pollable_from_connection_write(
+  processx_pollable_t *pollable,
+  processx_connection_t *ccon);
+
 int processx_c_pollable_from_curl(
   processx_pollable_t *pollable, SEXP fds);
 
@@ -229,6 +290,12 @@ processx_file_handle_t processx_c_connection_fileno(
 /* Internals                                                             */
 /* --------------------------------------------------------------------- */
 
+/* Reading, for the run() engine, see run.c */
+
+ssize_t processx__connection_read(processx_connection_t *ccon);
+SEXP processx__connection_drain(processx_connection_t *ccon,
+				SEXP buf, R_xlen_t *size);
+
 #ifndef _WIN32
 typedef unsigned long DWORD;
 #endif
@@ -276,6 +343,25 @@ typedef struct processx__connection_freelist_s {
   struct processx__connection_freelist_s *next;
 } processx__connection_freelist_t;
 
+/* Registration in a poller, see poller.c */
+
+ssize_t processx__poller_touch(processx_connection_t *ccon);
+void processx__poller_release(processx_connection_t *ccon);
+int processx__poller_pending(processx_connection_t *ccon);
+
+/* Reading in a background thread, see unix/reader.c */
+
+#ifndef _WIN32
+ssize_t processx__reader_read(processx_connection_t *ccon, char *buf,
+			     size_t size);
+int processx__reader_pending(processx_connection_t *ccon);
+int processx__reader_fd(processx_connection_t *ccon);
+double processx__reader_bytes(processx_connection_t *ccon);
+void processx__reader_stop(processx_connection_t *ccon);
+#endif
+void processx__poller_closed(processx_connection_t *ccon);
+void processx__poller_forget(processx_connection_t *ccon);
+
 int processx__connection_freelist_add(processx_connection_t *con);
 void processx__connection_freelist_remove(processx_connection_t *con);
 int processx__connection_schedule_destroy(processx_connection_t *con);
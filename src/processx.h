@@ -56,10 +56,31 @@ SEXP processx_kill(SEXP status, SEXP grace, SEXP name);
 SEXP processx_get_pid(SEXP status);
 SEXP processx_create_time(SEXP r_pid);
 
-SEXP processx_poll(SEXP statuses, SEXP conn, SEXP ms);
+SEXP processx_poll(SEXP statuses, SEXP conn, SEXP ms, SEXP sparse,
+		   SEXP bytes);
+
+SEXP processx_run(SEXP cons, SEXP timeout, SEXP callbacks, SEXP echo,
+		  SEXP captures, SEXP resenv);
+
+SEXP processx_capture_create(SEXP type, SEXP size, SEXP head, SEXP lines);
+SEXP processx_capture_push(SEXP capture, SEXP data);
+SEXP processx_capture_read(SEXP capture);
+
+SEXP processx_poller_create(SEXP io_uring);
+SEXP processx_poller_add(SEXP poller, SEXP id, SEXP type, SEXP object);
+SEXP processx_poller_remove(SEXP poller, SEXP id);
+SEXP processx_poller_poll(SEXP poller, SEXP ms);
+SEXP processx_poller_info(SEXP poller);
+SEXP processx_poller_attach(SEXP poller, SEXP callback);
+SEXP processx_poller_detach(SEXP poller);
+
+SEXP processx_timer_create(SEXP timeout, SEXP interval);
+SEXP processx_timer_status(SEXP timer);
 
 SEXP processx__process_exists(SEXP pid);
 SEXP processx__proc_start_time(SEXP status);
+SEXP processx__pidfd_supported(void);
+SEXP processx__pidfd_connection(SEXP status, SEXP encoding);
 SEXP processx__unload_cleanup();
 
 SEXP processx_is_named_pipe_open(SEXP pipe_ext);
@@ -69,6 +90,16 @@ SEXP processx_write_named_pipe(SEXP pipe_ext, SEXP text);
 
 SEXP processx_disable_crash_dialog();
 
+SEXP processx_connection_tee(SEXP con, SEXP filename);
+SEXP processx_tee_status(SEXP tee);
+SEXP processx_tee_wait(SEXP tee, SEXP timeout);
+
+SEXP processx_connection_feed(SEXP con, SEXP data);
+SEXP processx_feed_status(SEXP feed);
+
+SEXP processx_connection_start_reader(SEXP con, SEXP high_water);
+SEXP processx_reader_status(SEXP con);
+
 SEXP processx_base64_encode(SEXP array);
 SEXP processx_base64_decode(SEXP array);
 
@@ -101,6 +132,24 @@ SEXP processx_base64_decode(SEXP array);
 #define PXHANDLE  7             /* need to poll the set handle */
 #define PXSELECT  8             /* need to poll/select the set fd */
 
+/* Timers, see timer.c */
+
+typedef struct processx_timer_s processx_timer_t;
+
+int processx_c_pollable_from_timer(processx_pollable_t *pollable,
+				   processx_timer_t *timer);
+double processx__timer_now(void);
+int processx__timer_remaining(processx_timer_t *timer);
+int processx__timer_check(processx_timer_t *timer, int event);
+
+/* Output capture buffers, see capture.c */
+
+typedef struct processx_capture_s processx_capture_t;
+
+void processx__capture_push(processx_capture_t *capture, const char *data,
+			    size_t n);
+SEXP processx__capture_string(processx_capture_t *capture);
+
 typedef struct {
   int windows_verbatim_args;
   int windows_hide;
@@ -0,0 +1,251 @@
+
+#include <math.h>
+#include <limits.h>
+
+#include "processx.h"
+
+/* The main loop of run()
+ *
+ * This reads the standard output and error of the process until both
+ * are closed, calls the line and chunk callbacks, echoes the output,
+ * and kills the process at the timeout. It does the same as
+ * `run_manage()` in R, but it only wakes up if there is output, or at
+ * the timeout.
+ *
+ * The output is collected in raw vectors, these are also assigned in
+ * `resenv`, with their sizes, so `run()` can get the partial output
+ * after an interrupt. Callbacks are called in the order of the output
+ * of a single stream, and their errors are not caught, just like in
+ * `run_manage()`.
+ *
+ * If a stream has a capture buffer, see capture.c, then the output goes
+ * there instead, and `buf` only keeps the incomplete line, for the line
+ * callback.
+ */
+
+typedef struct processx__run_stream_s {
+  processx_connection_t *ccon;
+  SEXP buf;			/* the output, protected */
+  PROTECT_INDEX idx;
+  R_xlen_t size;		/* bytes in `buf` */
+  R_xlen_t line_start;		/* start of the incomplete line */
+  SEXP line_callback, callback;
+  const char *echo_pre, *echo_post;
+  SEXP buf_sym;			/* in `resenv` */
+  SEXP size_sexp;		/* in `resenv`, updated in place */
+  processx_capture_t *capture;	/* or NULL to keep everything */
+} processx__run_stream_t;
+
+static SEXP processx__run_string(const char *data, R_xlen_t size) {
+  if (size > INT_MAX) {
+    R_THROW_ERROR("Output is too long for a single string");
+  }
+  return ScalarString(mkCharLenCE(data, (int) size, CE_UTF8));
+}
+
+static void processx__run_call(SEXP fun, SEXP arg, SEXP proc) {
+  SEXP call = PROTECT(lang3(fun, arg, proc));
+  eval(call, R_GlobalEnv);
+  UNPROTECT(1);
+}
+
+/* Rprintf() stops at the first NUL byte, and its precision is an int,
+   so we echo in bounded chunks, and skip the NUL bytes. `cat()` cannot
+   print them, either. */
+
+#define PROCESSX__RUN_ECHO_CHUNK (64 * 1024)
+
+static void processx__run_echo(const char *data, R_xlen_t len) {
+  const char *end = data + len;
+  while (data < end) {
+    R_xlen_t n = end - data;
+    const char *nul;
+    if (n > PROCESSX__RUN_ECHO_CHUNK) n = PROCESSX__RUN_ECHO_CHUNK;
+    nul = memchr(data, '\0', n);
+    if (nul) n = nul - data;
+    if (n > 0) Rprintf("%.*s", (int) n, data);
+    data += nul ? n + 1 : n;
+  }
+}
+
+/* Move the new output to `buf`, and process it. Returns 1 if the
+   stream has finished. */
+
+static int processx__run_collect(processx__run_stream_t *stream,
+				 SEXP resenv, SEXP proc) {
+  processx_connection_t *ccon = stream->ccon;
+  R_xlen_t old = stream->size;
+  SEXP oldbuf = stream->buf;
+
+  if (processx_c_connection_is_closed(ccon)) return 1;
+
+  REPROTECT(stream->buf = processx__connection_drain(ccon, stream->buf,
+						     &stream->size),
+	    stream->idx);
+  if (stream->buf != oldbuf) {
+    defineVar(stream->buf_sym, stream->buf, resenv);
+  }
+  REAL(stream->size_sexp)[0] = (double) stream->size;
+
+  if (stream->size > old) {
+    const char *data = (const char*) RAW(stream->buf);
+    R_xlen_t len = stream->size - old;
+
+    if (stream->capture) {
+      processx__capture_push(stream->capture, data + old, len);
+    }
+
+    if (stream->echo_pre) {
+      Rprintf("%s", stream->echo_pre);
+      processx__run_echo(data + old, len);
+      Rprintf("%s", stream->echo_post);
+    }
+
+    if (!isNull(stream->callback)) {
+      /* With echo, the R loop passes the styled text to the callback,
+	 see echo_callback(), so we do the same */
+      SEXP chunk;
+      if (stream->echo_pre &&
+	  (stream->echo_pre[0] || stream->echo_post[0])) {
+	const void *vmax = vmaxget();
+	size_t prelen = strlen(stream->echo_pre);
+	size_t postlen = strlen(stream->echo_post);
+	char *styled = R_alloc(prelen + len + postlen, 1);
+	memcpy(styled, stream->echo_pre, prelen);
+	memcpy(styled + prelen, data + old, len);
+	memcpy(styled + prelen + len, stream->echo_post, postlen);
+	chunk = PROTECT(processx__run_string(styled, prelen + len + postlen));
+	vmaxset(vmax);
+      } else {
+	chunk = PROTECT(processx__run_string(data + old, len));
+      }
+      processx__run_call(stream->callback, chunk, proc);
+      UNPROTECT(1);
+    }
+
+    if (!isNull(stream->line_callback)) {
+      const char *nl;
+      while ((nl = memchr(data + old, '\n', stream->size - old))) {
+	const char *start = data + stream->line_start;
+	R_xlen_t linelen = nl - start;
+	SEXP line;
+	if (linelen > 0 && start[linelen - 1] == '\r') linelen--;
+	line = PROTECT(processx__run_string(start, linelen));
+	processx__run_call(stream->line_callback, line, proc);
+	UNPROTECT(1);
+	stream->line_start = old = nl + 1 - data;
+      }
+    }
+
+    if (stream->capture) {
+      R_xlen_t keep = isNull(stream->line_callback) ? 0 :
+	stream->size - stream->line_start;
+      memmove(RAW(stream->buf), data + stream->size - keep, keep);
+      stream->size = keep;
+      stream->line_start = 0;
+      REAL(stream->size_sexp)[0] = (double) keep;
+    }
+  }
+
+  /* A callback might have closed the connection, e.g. by killing the
+     process */
+  return processx_c_connection_is_closed(ccon) || ccon->is_eof_;
+}
+
+SEXP processx_run(SEXP cons, SEXP timeout, SEXP callbacks, SEXP echo,
+		  SEXP captures, SEXP resenv) {
+  const char *names[] = { "stdout", "stderr", "timeout", "" };
+  const char *buf_names[] = { "stdout_buf", "stderr_buf" };
+  const char *size_names[] = { "stdout_size", "stderr_size" };
+  double ctimeout = REAL(timeout)[0];
+  double deadline = ctimeout >= 0 ? processx__timer_now() + ctimeout : -1;
+  SEXP on_timeout = VECTOR_ELT(callbacks, 4);
+  SEXP proc = VECTOR_ELT(callbacks, 5);
+  processx__run_stream_t streams[2];
+  processx_pollable_t pollables[2];
+  int active[2] = { 0, 0 };
+  int timeout_happened = 0;
+  int i;
+  SEXP result;
+
+  for (i = 0; i < 2; i++) {
+    processx__run_stream_t *stream = &streams[i];
+    SEXP con = VECTOR_ELT(cons, i);
+    SEXP capture = VECTOR_ELT(captures, i);
+    stream->ccon = isNull(con) ? NULL : R_ExternalPtrAddr(con);
+    stream->capture = isNull(capture) ? NULL : R_ExternalPtrAddr(capture);
+    stream->size = stream->line_start = 0;
+    stream->line_callback = VECTOR_ELT(callbacks, 2 * i);
+    stream->callback = VECTOR_ELT(callbacks, 2 * i + 1);
+    stream->echo_pre = isNull(echo) ? NULL :
+      CHAR(STRING_ELT(echo, 2 * i));
+    stream->echo_post = isNull(echo) ? NULL :
+      CHAR(STRING_ELT(echo, 2 * i + 1));
+    stream->buf_sym = install(buf_names[i]);
+    PROTECT_WITH_INDEX(stream->buf = allocVector(RAWSXP, 16 * 1024),
+		       &stream->idx);
+    stream->size_sexp = PROTECT(ScalarReal(0));
+    defineVar(stream->buf_sym, stream->buf, resenv);
+    defineVar(install(size_names[i]), stream->size_sexp, resenv);
+    active[i] = stream->ccon != NULL &&
+      !processx_c_connection_is_closed(stream->ccon);
+  }
+
+  while (1) {
+    int npollables = 0, wait = -1;
+    int which[2];
+
+    for (i = 0; i < 2; i++) {
+      if (active[i] && processx__run_collect(&streams[i], resenv, proc)) {
+	active[i] = 0;
+      }
+    }
+    if (!active[0] && !active[1]) break;
+
+    for (i = 0; i < 2; i++) {
+      if (!active[i]) continue;
+      processx_c_pollable_from_connection(&pollables[npollables],
+					  streams[i].ccon);
+      which[npollables++] = i;
+    }
+
+    if (deadline >= 0) {
+      double rem = ceil(deadline - processx__timer_now());
+      wait = rem < 0 ? 0 : (rem > INT_MAX ? INT_MAX : (int) rem);
+    }
+
+    processx_c_connection_poll(pollables, npollables, wait);
+
+    if (deadline >= 0 && processx__timer_now() >= deadline) {
+      /* Kill the process, and keep reading until the end of the
+	 output, without a deadline. */
+      SEXP call = PROTECT(lang1(on_timeout));
+      SEXP ret = PROTECT(eval(call, R_GlobalEnv));
+      timeout_happened = LOGICAL(ret)[0] == TRUE;
+      UNPROTECT(2);
+      deadline = -1;
+    }
+
+    for (i = 0; i < npollables; i++) {
+      processx__run_stream_t *stream = &streams[which[i]];
+      if (pollables[i].event == PXREADY &&
+	  !processx_c_connection_is_closed(stream->ccon)) {
+	processx__connection_read(stream->ccon);
+      }
+    }
+  }
+
+  result = PROTECT(mkNamed(VECSXP, names));
+  for (i = 0; i < 2; i++) {
+    if (streams[i].ccon && streams[i].capture) {
+      SET_VECTOR_ELT(result, i, processx__capture_string(streams[i].capture));
+    } else if (streams[i].ccon) {
+      SET_VECTOR_ELT(result, i, processx__run_string(
+        (const char*) RAW(streams[i].buf), streams[i].size));
+    }
+  }
+  SET_VECTOR_ELT(result, 2, ScalarLogical(timeout_happened));
+
+  UNPROTECT(5);
+  return result;
+}
@@ -4,16 +4,27 @@
 // detects that the parent process has died, it will kill all the child
 // processes.
 //
-// Every 0.2 seconds, it does the following:
-// * Checks for any new process IDs on standard input, and adds them to the list
-//   of child processes to track. If the PID is negative, as in "-1234", then
-//   that value will be negated and removed from the list of processes to track.
-// * Checks if any child processes have died. If so, remove them from the list
-//   of child processes to track.
-// * Checks if the parent process has died. If so, kill all children and exit.
+// It does the following:
+// * Reads new process IDs from standard input, and adds them to the set of
+//   child processes to track. If the PID is negative, as in "-1234", then
+//   that value will be negated and removed from the set of processes to track.
+//   R sends the PIDs in batches, as lines like "w 12 1234 -1235 1236", where
+//   12 is the sequence number of the batch, and the supervisor replies with
+//   "ack 12" on standard output, once it has processed the batch. R waits
+//   for this when it registers a process.
+// * Removes child processes that have died from the set.
+// * If the parent process has died, kills all children and exits.
+//
+// The children are kept in a hash set, so there is no limit on their number,
+// and adding and removing them takes constant time. On Linux 5.3 and above
+// every child and the parent has a pidfd, and the supervisor sleeps in
+// epoll_wait() until one of them exits, or there is input, or a signal, so it
+// is idle if nothing happens. For processes without a pidfd, e.g. on other
+// platforms, or if we run out of file descriptors, it checks every 0.2
+// seconds whether they are still running.
 //
 // To test it out in verbose mode, run:
-//   gcc supervisor.c -o supervisor
+//   gcc supervisor.c utils.c -o supervisor
 //   ./supervisor -v -p [parent_pid]
 //
 // The [parent_pid] is optional. If not supplied, the supervisor will auto-
@@ -46,6 +57,15 @@
 
 #ifdef WIN32
 #include "windows.h"
+#else
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <stdint.h>
 #endif
 
 #include "utils.h"
@@ -54,20 +74,38 @@
 
 // Size of stdin input buffer
 #define INPUT_BUF_LEN 1024
-// Maximum number of children to keep track of
-#define MAX_CHILDREN 1024
-// Milliseconds to sleep in polling loop
+// Milliseconds to sleep in polling loop, if some processes cannot be watched
 #define POLL_MS 200
+// Maximum number of events handled by one epoll_wait()
+#define MAX_EVENTS 256
+
+// Tags of the epoll events that are not children. Children are tagged with
+// their (positive) pid.
+#define TAG_INPUT  -1
+#define TAG_SIGNAL -2
+#define TAG_PARENT -3
+#define TAG_STDOUT -4
 
 // Globals --------------------------------------------------------------------
 
 // Child processes to track
-int children[MAX_CHILDREN];
-int n_children = 0;
+pid_set children = { NULL, 0, 0 };
+
+// Number of children without a pidfd, these need polling
+int n_unwatched = 0;
 
 int sigint_received  = false;
 int sigterm_received = false;
 
+#ifndef WIN32
+// The signal handler writes to this pipe, to wake up the main loop
+int signal_pipe[2] = { -1, -1 };
+#endif
+
+#ifdef __linux__
+int epoll_fd = -1;
+#endif
+
 // Utility functions ----------------------------------------------------------
 
 // Cross-platform sleep function
@@ -96,6 +134,7 @@ void sleep_ms(int milliseconds) {
 // Given a string of format "102", return 102. If conversion fails because it
 // is out of range, or because the string can't be parsed, return 0.
 int extract_pid(char* buf, int len) {
+    errno = 0;
     long pid = strtol(buf, NULL, 10);
 
     // Out of range: errno is ERANGE if it's out of range for a long. We're
@@ -139,68 +178,278 @@ bool pid_is_running(pid_t pid) {
     #endif
 }
 
-// Send a soft kill signal to all children, wait 5 seconds, then hard kill any
-// remaining processes.
-void kill_children() {
-    if (n_children == 0)
+
+// Watching processes ---------------------------------------------------------
+
+// Returns a pidfd, registered in epoll with `tag`, or -1 if this is not
+// possible. Then the process needs polling.
+int watch_pid(int pid, int tag) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    if (epoll_fd == -1)
+        return -1;
+
+    int fd = (int) syscall(SYS_pidfd_open, pid, 0);
+    if (fd == -1)
+        return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t) (int64_t) tag;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+void add_child(int pid) {
+    bool added;
+    pid_entry* entry = pid_set_add(&children, pid, &added);
+    if (entry == NULL) {
+        fprintf(stderr, "Cannot add %d, out of memory\n", pid);
+        return;
+    }
+    if (!added) {
+        verbose_printf("Not adding (already present):%d\n", pid);
         return;
+    }
 
-    verbose_printf("Sending close signal to children: ");
-    for (int i=0; i<n_children; i++) {
-        verbose_printf("%d ", children[i]);
+    verbose_printf("Adding:%d\n", pid);
+    entry->fd = watch_pid(pid, pid);
+    if (entry->fd == -1)
+        n_unwatched++;
+}
 
-        #ifdef WIN32
-        sendCtrlC(children[i]);
-        sendWmClose(children[i]);
-        #else
-        kill(children[i], SIGTERM);
-        #endif
+// Closing the pidfd also removes it from epoll
+void remove_child(pid_entry* entry) {
+    if (entry->fd == -1) {
+        n_unwatched--;
+    } else {
+        close(entry->fd);
     }
-    verbose_printf("\n");
+    pid_set_remove(&children, entry);
+}
+
+// Remove the children without a pidfd that are not running any more. With
+// pidfds we get an event instead. If `all` is true, check every child.
+void check_children(bool all) {
+    size_t n_check = all ? children.size : (size_t) n_unwatched;
+    if (n_check == 0)
+        return;
+
+    // Removing entries moves other entries, so collect them first
+    int* stopped = malloc(n_check * sizeof(int));
+    int n_stopped = 0;
+    if (stopped == NULL)
+        return;
+
+    for (size_t i=0; i<children.capacity; i++) {
+        pid_entry* entry = &children.slots[i];
+        if (entry->pid != 0 && (all || entry->fd == -1) &&
+            !pid_is_running(entry->pid)) {
+            stopped[n_stopped++] = entry->pid;
+        }
+    }
+
+    for (int i=0; i<n_stopped; i++) {
+        verbose_printf("%d(stopped) ", stopped[i]);
+        remove_child(pid_set_find(&children, stopped[i]));
+    }
+    if (n_stopped > 0)
+        verbose_printf("\n");
+
+    free(stopped);
+}
+
+void handle_pid(int pid) {
+    if (pid > 0) {
+        add_child(pid);
+
+    } else if (pid < 0) {
+        // Remove pids that start with '-'
+        pid_entry* entry = pid_set_find(&children, -pid);
+        if (entry != NULL) {
+            verbose_printf("Removing:%d\n", -pid);
+            remove_child(entry);
+        }
+    }
+}
+
+// Acknowledge a batch. Acknowledgements are cumulative, so if the pipe is
+// full, then we keep the last one, and send it when stdout is writeable.
+bool ack_pending = false;
+unsigned long ack_seq = 0;
+// Whether stdout is in the epoll set, because an ack is pending
+bool stdout_watched = false;
+
+void send_ack(unsigned long seq) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "ack %lu\n", seq);
+
+    #ifdef WIN32
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    #else
+    struct pollfd fd;
+    fd.fd = STDOUT_FILENO;
+    fd.events = POLLOUT;
+    fd.revents = 0;
+    fflush(stdout);
+    ack_pending = true;
+    ack_seq = seq;
+    if (poll(&fd, 1, 0) == 1 && (fd.revents & POLLOUT)) {
+        ssize_t ret = write(STDOUT_FILENO, buf, len);
+        if (ret == len || (ret == -1 && errno != EAGAIN)) {
+            ack_pending = false;
+        }
+    }
+    #endif
+}
+
+// Handle a line of input. Returns true for the "kill" command.
+bool handle_input_line(char* line) {
+    if (strncmp(line, "kill", 4) == 0) {
+        verbose_printf("\'kill' command received.\n");
+        return true;
+    }
+
+    if (line[0] == 'w' && line[1] == ' ') {
+        char* p = line + 2;
+        char* end;
+        unsigned long seq = strtoul(p, &end, 10);
+        if (end == p)
+            return false;
+
+        while (1) {
+            p = end;
+            errno = 0;
+            long pid = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            if (errno != ERANGE && pid <= INT_MAX && pid >= INT_MIN)
+                handle_pid((int) pid);
+        }
 
+        verbose_printf("Batch %lu done.\n", seq);
+        send_ack(seq);
+        return false;
+    }
 
+    handle_pid(extract_pid(line, INPUT_BUF_LEN));
+    return false;
+}
+
+
+// Wait until the children have exited, for at most `timeout_ms`.
+void wait_children(int timeout_ms) {
     // Poll, checking that child processes have exited. Using `time()` isn't
     // the most accurate way to get time, since it only has a resolution of 1
     // second, but it is cross-platform and good enough for this purpose.
-    time_t stop_time = time(NULL) + 5;
+    time_t stop_time = time(NULL) + timeout_ms / 1000;
 
     do {
-        sleep_ms(POLL_MS);
-
-        verbose_printf("Checking status of children: ");
-        for (int i=0; i<n_children; i++) {
-            if (pid_is_running(children[i])) {
-                verbose_printf("%d ", children[i]);
-            } else {
-                verbose_printf("%d(stopped) ", children[i]);
-                n_children = remove_element(children, n_children, i);
+#ifdef __linux__
+        if (epoll_fd != -1 && n_unwatched < (int) children.size) {
+            struct epoll_event events[MAX_EVENTS];
+            int n = epoll_wait(epoll_fd, events, MAX_EVENTS, POLL_MS);
+            for (int i=0; i<n; i++) {
+                int tag = (int) (int64_t) events[i].data.u64;
+                pid_entry* entry = tag > 0 ?
+                    pid_set_find(&children, tag) : NULL;
+                if (entry != NULL) {
+                    verbose_printf("%d(stopped) ", tag);
+                    remove_child(entry);
+                }
             }
+        } else {
+            sleep_ms(POLL_MS);
         }
-        verbose_printf("\n");
+#else
+        sleep_ms(POLL_MS);
+#endif
 
-        if (n_children == 0) {
+        // Check the ones without a pidfd, or all of them without epoll
+#ifdef __linux__
+        check_children(epoll_fd == -1);
+#else
+        check_children(true);
+#endif
+        verbose_printf("Children left: %d\n", (int) children.size);
+
+        if (children.size == 0) {
             return;
         }
     } while(time(NULL) < stop_time);
+}
 
+// Send a soft kill signal to all children, wait 5 seconds, then hard kill any
+// remaining processes.
+void kill_children() {
+    if (children.size == 0)
+        return;
+
+#ifdef __linux__
+    // Only the children are interesting from now on
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (size_t i=0; epoll_fd != -1 && i<children.capacity; i++) {
+            pid_entry* entry = &children.slots[i];
+            if (entry->pid != 0 && entry->fd != -1) {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u64 = (uint64_t) (int64_t) entry->pid;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, entry->fd, &ev);
+            }
+        }
+    }
+#endif
+
+    verbose_printf("Sending close signal to children: ");
+    for (size_t i=0; i<children.capacity; i++) {
+        int pid = children.slots[i].pid;
+        if (pid == 0)
+            continue;
+
+        verbose_printf("%d ", pid);
+
+        #ifdef WIN32
+        sendCtrlC(pid);
+        sendWmClose(pid);
+        #else
+        kill(pid, SIGTERM);
+        #endif
+    }
+    verbose_printf("\n");
+
+    wait_children(5000);
+    if (children.size == 0)
+        return;
 
     // Hard-kill any remaining processes
     bool kill_message_shown = false;
 
-    for (int i=0; i<n_children; i++) {
-        if (pid_is_running(children[i])) {
+    for (size_t i=0; i<children.capacity; i++) {
+        int pid = children.slots[i].pid;
+        if (pid != 0 && pid_is_running(pid)) {
 
             if (!kill_message_shown) {
                 verbose_printf("Sending kill signal to children: ");
                 kill_message_shown = true;
             }
 
-            verbose_printf("%d ", children[i]);
+            verbose_printf("%d ", pid);
 
             #ifdef WIN32
-            kill_pid(children[i]);
+            kill_pid(pid);
             #else
-            kill(children[i], SIGKILL);
+            kill(pid, SIGKILL);
             #endif
         }
     }
@@ -224,6 +473,13 @@ static void sig_handler(int signum) {
         signame = "Unknown signal";
     }
 
+    #ifndef WIN32
+    // Wake up the main loop
+    int saved_errno = errno;
+    if (signal_pipe[1] != -1 && write(signal_pipe[1], "x", 1) == -1) { }
+    errno = saved_errno;
+    #endif
+
     verbose_printf("%s received.\n", signame);
 }
 
@@ -313,29 +569,71 @@ int main(int argc, char **argv) {
 
     #else
 
-    FILE* fp_input;
+    int input_fd;
+    size_t input_len = 0;
+    bool input_open = true;
 
     if (input_pipe_name == NULL) {
-        fp_input = stdin;
+        input_fd = STDIN_FILENO;
 
     } else {
-        printf("fopen.\n");
-
-        fp_input = fopen(input_pipe_name, "r");
-        printf("fopened.\n");
-        if (fp_input == NULL) {
+        input_fd = open(input_pipe_name, O_RDONLY | O_CLOEXEC);
+        if (input_fd == -1) {
             printf("Unable to open %s for reading.\n", input_pipe_name);
             exit(1);
         }
     }
 
-    if (fcntl(fileno(fp_input), F_SETFL, O_NONBLOCK) == -1) {
+    if (fcntl(input_fd, F_SETFL, O_NONBLOCK) == -1) {
         printf("Error setting input to non-blocking mode.\n");
         exit(1);
     }
 
+    if (pipe(signal_pipe) == -1 ||
+        fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+        printf("Error creating signal pipe.\n");
+        exit(1);
+    }
+
     #endif
 
+    #ifdef __linux__
+
+    // Every child needs a pidfd, so use as many fds as we are allowed to
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd != -1) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t) (int64_t) TAG_INPUT;
+        int ret1 = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &ev);
+        ev.data.u64 = (uint64_t) (int64_t) TAG_SIGNAL;
+        int ret2 = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_pipe[0], &ev);
+        if (ret1 == -1 || ret2 == -1) {
+            // E.g. regular files cannot be used with epoll
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+    }
+
+    #endif
+
+    // If we have no pidfd for the parent, then we need to poll it
+    #ifndef WIN32
+    int parent_fd = watch_pid(parent_pid, TAG_PARENT);
+    #else
+    int parent_fd = -1;
+    #endif
+    verbose_printf("Watching parent with %s.\n",
+                   parent_fd == -1 ? "polling" : "pidfd");
+
     printf("Ready\n");
     fflush(stdout);
 
@@ -361,7 +659,7 @@ int main(int argc, char **argv) {
     #endif
 
 
-    // Poll -------------------------------------------------------------------
+    // Main loop --------------------------------------------------------------
     while(1) {
 
         // Check if a sigint or sigterm has been received. If so, then kill
@@ -375,79 +673,162 @@ int main(int argc, char **argv) {
             exit(0);
         }
 
+        bool input_ready = false;
+        bool parent_exited = false;
 
-        // Look for any new processes IDs from the input
-        char* res = NULL;
+        if (ack_pending) send_ack(ack_seq);
 
-        // Read in the input buffer. There could be multiple lines so we'll
-        // keep reading lines until there's no more content.
-        while(1) {
-            #ifdef WIN32
-            res = get_line_nonblock(readbuf, INPUT_BUF_LEN, h_input);
-            #else
-            res = fgets(readbuf, INPUT_BUF_LEN, fp_input);
-            #endif
+        #ifdef WIN32
+
+        sleep_ms(POLL_MS);
+        input_ready = true;
+
+        #else
+
+        #ifdef __linux__
+        if (epoll_fd != -1) {
+            // Wait for stdout to become writeable, if an ack is pending
+            if (ack_pending != stdout_watched) {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLOUT;
+                ev.data.u64 = (uint64_t) (int64_t) TAG_STDOUT;
+                int op = ack_pending ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+                if (epoll_ctl(epoll_fd, op, STDOUT_FILENO, &ev) == 0 ||
+                    !ack_pending) {
+                    stdout_watched = ack_pending;
+                }
+            }
+
+            // Only poll periodically if something cannot be watched
+            int timeout = (n_unwatched > 0 || parent_fd == -1 ||
+                           ack_pending != stdout_watched) ? POLL_MS : -1;
+            struct epoll_event events[MAX_EVENTS];
+            int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+            for (int i=0; i<n; i++) {
+                int tag = (int) (int64_t) events[i].data.u64;
+                if (tag == TAG_INPUT) {
+                    input_ready = true;
+
+                } else if (tag == TAG_SIGNAL) {
+                    char buf[64];
+                    while (read(signal_pipe[0], buf, sizeof(buf)) > 0) ;
+
+                } else if (tag == TAG_PARENT) {
+                    parent_exited = true;
+
+                } else if (tag == TAG_STDOUT) {
+                    // The pending ack is sent in the next iteration
+
+                } else {
+                    pid_entry* entry = pid_set_find(&children, tag);
+                    if (entry != NULL) {
+                        verbose_printf("%d(stopped)\n", tag);
+                        remove_child(entry);
+                    }
+                }
+            }
+        } else
+        #endif
+        {
+            struct pollfd fds[3];
+            int nfds = 0;
+            fds[nfds].fd = signal_pipe[0];
+            fds[nfds++].events = POLLIN;
+            if (ack_pending) {
+                fds[nfds].fd = STDOUT_FILENO;
+                fds[nfds++].events = POLLOUT;
+            }
+            int input_idx = nfds;
+            if (input_open) {
+                fds[nfds].fd = input_fd;
+                fds[nfds++].events = POLLIN;
+            }
+            if (poll(fds, nfds, POLL_MS) > 0) {
+                char buf[64];
+                while (read(signal_pipe[0], buf, sizeof(buf)) > 0) ;
+                input_ready = input_open && fds[input_idx].revents != 0;
+            }
+        }
+
+        #endif
+
+        // Look for any new processes IDs from the input. There could be
+        // multiple lines so we'll keep reading lines until there's no more
+        // content.
+        #ifdef WIN32
 
+        while (input_ready) {
+            char* res = get_line_nonblock(readbuf, INPUT_BUF_LEN, h_input);
             if (res == NULL)
                 break;
 
-            if (strncmp(readbuf, "kill", 4) == 0) {
-                verbose_printf("\'kill' command received.\n");
+            if (handle_input_line(readbuf)) {
                 kill_children();
                 verbose_printf("\nExiting.\n");
                 return 0;
             }
-            int pid = extract_pid(readbuf, INPUT_BUF_LEN);
-            if (pid > 0) {
-                if (n_children == MAX_CHILDREN) {
-                    printf(
-                        "Number of child processes to watch has exceeded limit of %d.",
-                        MAX_CHILDREN
-                    );
+        }
 
-                } else if (array_contains(children, n_children, pid)) {
-                    verbose_printf("Not adding (already present):%d\n", pid);
+        #else
 
-                } else {
-                    verbose_printf("Adding:%d\n", pid);
-                    children[n_children] = pid;
-                    n_children++;
-                }
+        while (input_ready && input_open) {
+            ssize_t n = read(input_fd, readbuf + input_len,
+                             INPUT_BUF_LEN - 1 - input_len);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1)
+                break;
 
-            } else if (pid < 0) {
-                // Remove pids that start with '-'
-                pid = -pid;
-                for (int i=0; i<n_children; i++) {
-                    if (children[i] == pid) {
-                        verbose_printf("Removing:%d\n", pid);
-                        n_children = remove_element(children, n_children, i);
-                        break;
-                    }
-                }
+            if (n == 0) {
+                // No more input, e.g. the parent closed the pipe. The parent
+                // pidfd tells us when it exits.
+                verbose_printf("End of input.\n");
+                input_open = false;
+                #ifdef __linux__
+                if (epoll_fd != -1)
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, input_fd, NULL);
+                #endif
+                break;
             }
-        }
 
-        // Remove any children from list that are no longer running.
-        verbose_printf("Children: ");
-        for (int i=0; i<n_children; i++) {
-            if (pid_is_running(children[i])) {
-                verbose_printf("%d ", children[i]);
-            } else {
-                verbose_printf("%d(stopped) ", children[i]);
-                n_children = remove_element(children, n_children, i);
+            input_len += n;
+            readbuf[input_len] = '\0';
+
+            char* line = readbuf;
+            char* nl;
+            while ((nl = strchr(line, '\n')) != NULL) {
+                *nl = '\0';
+                if (handle_input_line(line)) {
+                    kill_children();
+                    verbose_printf("\nExiting.\n");
+                    return 0;
+                }
+                line = nl + 1;
             }
+
+            // Keep the incomplete line. If the buffer is full, then the line
+            // is too long, and we drop it.
+            input_len = readbuf + input_len - line;
+            memmove(readbuf, line, input_len);
+            if (input_len == INPUT_BUF_LEN - 1)
+                input_len = 0;
         }
-        verbose_printf("\n");
+
+        #endif
+
+        // Remove any children that are not running any more, and that we
+        // cannot watch.
+        check_children(false);
 
         // Check that parent is still running. If not, kill children.
-        if (!pid_is_running(parent_pid)) {
+        if (parent_exited ||
+            (parent_fd == -1 && !pid_is_running(parent_pid))) {
             verbose_printf("Parent (%d) is no longer running.\n", parent_pid);
             kill_children();
             verbose_printf("\nExiting.\n");
             return 0;
         }
-
-        sleep_ms(POLL_MS);
     }
 
     return 0;
@@ -27,20 +27,102 @@ void verbose_printf(const char *format, ...) {
 }
 
 
-// Remove an element from an array by replacing it with the last element. Note
-// that this can alter the order of elements in the array. Returns new length
-// of array.
-int remove_element(int* ar, int len, int idx) {
-    ar[idx] = ar[len-1];
-    return len-1;
+// Set of process IDs --------------------------------------------------------
+//
+// This is an open addressing hash table with linear probing. The capacity is
+// a power of two, and the table grows when it is half full, so lookups,
+// insertions and removals take constant time on average. A zero pid marks an
+// empty slot. Removal shifts the following entries back, instead of leaving
+// tombstones, so the table never fills up with deleted entries.
+
+#define PID_SET_MIN_CAPACITY 64
+
+static size_t pid_set_hash(pid_set* set, int pid) {
+    // Fibonacci hashing, consecutive pids are spread over the table
+    return ((unsigned int) pid * 2654435769u) & (set->capacity - 1);
+}
+
+static bool pid_set_grow(pid_set* set) {
+    size_t old_capacity = set->capacity;
+    pid_entry* old_slots = set->slots;
+    size_t capacity = old_capacity ? old_capacity * 2 : PID_SET_MIN_CAPACITY;
+    pid_entry* slots = calloc(capacity, sizeof(pid_entry));
+    if (slots == NULL)
+        return false;
+
+    set->slots = slots;
+    set->capacity = capacity;
+    for (size_t i=0; i<old_capacity; i++) {
+        if (old_slots[i].pid != 0) {
+            size_t j = pid_set_hash(set, old_slots[i].pid);
+            while (slots[j].pid != 0)
+                j = (j + 1) & (capacity - 1);
+            slots[j] = old_slots[i];
+        }
+    }
+
+    free(old_slots);
+    return true;
+}
+
+pid_entry* pid_set_find(pid_set* set, int pid) {
+    if (set->size == 0)
+        return NULL;
+
+    size_t i = pid_set_hash(set, pid);
+    while (set->slots[i].pid != 0) {
+        if (set->slots[i].pid == pid)
+            return &set->slots[i];
+        i = (i + 1) & (set->capacity - 1);
+    }
+
+    return NULL;
 }
 
+// Returns the entry of the pid, or NULL if there is no memory. `added` is set
+// to true if the pid was not in the set, and then the new entry has fd -1.
+pid_entry* pid_set_add(pid_set* set, int pid, bool* added) {
+    pid_entry* entry = pid_set_find(set, pid);
+    *added = false;
+    if (entry != NULL)
+        return entry;
+
+    if ((set->size + 1) * 2 > set->capacity && !pid_set_grow(set))
+        return NULL;
+
+    size_t i = pid_set_hash(set, pid);
+    while (set->slots[i].pid != 0)
+        i = (i + 1) & (set->capacity - 1);
+
+    set->slots[i].pid = pid;
+    set->slots[i].fd = -1;
+    set->size++;
+    *added = true;
+    return &set->slots[i];
+}
+
+// Remove an entry, it must point into the table. The entries after it might
+// move back, so other pointers into the table are invalid after this.
+void pid_set_remove(pid_set* set, pid_entry* entry) {
+    size_t mask = set->capacity - 1;
+    size_t i = (size_t) (entry - set->slots);
+    size_t j = i;
+
+    while (1) {
+        j = (j + 1) & mask;
+        if (set->slots[j].pid == 0)
+            break;
 
-bool array_contains(int* ar, int len, int value) {
-    for (int i=0; i<len; i++) {
-        if (ar[i] == value)
-            return true;
+        // Move the entry at j back to the hole at i, unless its home slot
+        // is cyclically in (i, j], because then it is already reachable.
+        size_t home = pid_set_hash(set, set->slots[j].pid);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
     }
 
-    return false;
+    set->slots[i].pid = 0;
+    set->slots[i].fd = -1;
+    set->size--;
 }
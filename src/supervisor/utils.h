@@ -3,6 +3,7 @@
 #define R_PROCESSX_SUPERVISOR_UTILS_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 
 extern bool verbose_mode;
@@ -10,7 +11,20 @@ extern bool verbose_mode;
 
 void verbose_printf(const char *format, ...);
 
-int remove_element(int* ar, int len, int idx) ;
-bool array_contains(int* ar, int len, int value);
+// A supervised process, and its pidfd, or -1 if we do not have one
+typedef struct {
+    int pid;
+    int fd;
+} pid_entry;
+
+typedef struct {
+    pid_entry* slots;
+    size_t capacity;
+    size_t size;
+} pid_set;
+
+pid_entry* pid_set_find(pid_set* set, int pid);
+pid_entry* pid_set_add(pid_set* set, int pid, bool* added);
+void pid_set_remove(pid_set* set, pid_entry* entry);
 
 #endif
@@ -0,0 +1,185 @@
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#include "processx.h"
+
+/* Timers that can be polled
+ *
+ * A timer fires once, `timeout` milliseconds after it was created, or
+ * periodically, every `interval` milliseconds after that. On Linux it is
+ * a timerfd, so it is just another fd to poll, and the kernel wakes us
+ * up at the right time. Elsewhere, or if we cannot create a timerfd,
+ * `processx_poll()` limits the poll timeout to the next deadline
+ * instead, see `processx__timer_remaining()`.
+ *
+ * A one-shot timer stays ready after it fired, like a deadline. A
+ * periodic timer is ready once for every poll that sees it fire, and
+ * we count the expirations.
+ */
+
+struct processx_timer_s {
+  int fd;			/* timerfd, or -1 */
+  double next;			/* next deadline, if no timerfd */
+  double interval;		/* 0 for one-shot timers */
+  double expirations;
+  int expired;			/* one-shot timer has fired */
+};
+
+double processx__timer_now(void) {
+#ifdef _WIN32
+  return (double) GetTickCount64();
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+#endif
+}
+
+static void processx__timer_finalizer(SEXP ptr) {
+  processx_timer_t *timer = R_ExternalPtrAddr(ptr);
+  if (!timer) return;
+#ifndef _WIN32
+  if (timer->fd >= 0) close(timer->fd);
+#endif
+  free(timer);
+  R_ClearExternalPtr(ptr);
+}
+
+SEXP processx_timer_create(SEXP timeout, SEXP interval) {
+  double ctimeout = REAL(timeout)[0];
+  double cinterval = REAL(interval)[0];
+  processx_timer_t *timer = calloc(1, sizeof(processx_timer_t));
+  SEXP result;
+
+  if (!timer) R_THROW_ERROR("Cannot allocate memory for processx timer");
+  timer->fd = -1;
+  timer->interval = cinterval;
+  timer->next = processx__timer_now() + ctimeout;
+
+#ifdef __linux__
+  timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer->fd >= 0) {
+    struct itimerspec spec;
+    /* Zero would disarm the timer, so use a nanosecond instead */
+    if (ctimeout <= 0) ctimeout = 1e-6;
+    spec.it_value.tv_sec = (time_t) (ctimeout / 1000);
+    spec.it_value.tv_nsec = (long) (fmod(ctimeout, 1000) * 1000000);
+    spec.it_interval.tv_sec = (time_t) (cinterval / 1000);
+    spec.it_interval.tv_nsec = (long) (fmod(cinterval, 1000) * 1000000);
+    if (timerfd_settime(timer->fd, 0, &spec, NULL)) {
+      close(timer->fd);
+      timer->fd = -1;
+    }
+  }
+#endif
+
+  result = PROTECT(R_MakeExternalPtr(timer, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(result, processx__timer_finalizer, 1);
+  UNPROTECT(1);
+  return result;
+}
+
+static int processx_i_pre_poll_func_timer(processx_pollable_t *pollable) {
+  processx_timer_t *timer = pollable->object;
+  if (timer->expired) return PXREADY;
+#ifndef _WIN32
+  if (timer->fd >= 0) {
+    pollable->handle = timer->fd;
+    return PXHANDLE;
+  }
+#endif
+  return processx__timer_now() >= timer->next ? PXREADY : PXSILENT;
+}
+
+int processx_c_pollable_from_timer(processx_pollable_t *pollable,
+				   processx_timer_t *timer) {
+  pollable->pre_poll_func = processx_i_pre_poll_func_timer;
+  pollable->object = timer;
+  pollable->free = 0;
+  pollable->fds = R_NilValue;
+  pollable->write = 0;
+  return 0;
+}
+
+/* Milliseconds until the next deadline, for timers without a timerfd,
+   -1 otherwise. */
+
+int processx__timer_remaining(processx_timer_t *timer) {
+  double rem;
+  if (timer->fd >= 0) return -1;
+  if (timer->expired) return 0;
+  rem = ceil(timer->next - processx__timer_now());
+  return rem < 0 ? 0 : (rem > INT_MAX ? INT_MAX : (int) rem);
+}
+
+/* After a poll, check if the timer has fired, and count the
+   expirations. `event` is the result of the poll for this timer. */
+
+int processx__timer_check(processx_timer_t *timer, int event) {
+  if (timer->expired) return 1;
+
+#ifndef _WIN32
+  if (timer->fd >= 0) {
+    uint64_t count;
+    if (event != PXREADY) return 0;
+    if (read(timer->fd, &count, sizeof(count)) != sizeof(count)) return 0;
+    timer->expirations += (double) count;
+    if (timer->interval <= 0) timer->expired = 1;
+    return 1;
+  }
+#endif
+
+  {
+    double now = processx__timer_now();
+    if (now < timer->next) return 0;
+    if (timer->interval > 0) {
+      double n = floor((now - timer->next) / timer->interval) + 1;
+      timer->expirations += n;
+      timer->next += n * timer->interval;
+    } else {
+      timer->expirations += 1;
+      timer->expired = 1;
+    }
+    return 1;
+  }
+}
+
+SEXP processx_timer_status(SEXP ptr) {
+  processx_timer_t *timer = R_ExternalPtrAddr(ptr);
+  const char *names[] = { "expirations", "remaining", "timerfd", "" };
+  double remaining;
+  SEXP result;
+
+  if (!timer) R_THROW_ERROR("Invalid processx timer object");
+
+#ifdef __linux__
+  if (timer->fd >= 0) {
+    struct itimerspec spec;
+    if (timerfd_gettime(timer->fd, &spec)) {
+      R_THROW_SYSTEM_ERROR("Cannot query processx timer");
+    }
+    remaining = timer->expired ? 0 :
+      spec.it_value.tv_sec * 1000.0 + spec.it_value.tv_nsec / 1000000.0;
+  } else
+#endif
+  {
+    remaining = timer->expired ? 0 : timer->next - processx__timer_now();
+    if (remaining < 0) remaining = 0;
+  }
+
+  result = PROTECT(mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(result, 0, ScalarReal(timer->expirations));
+  SET_VECTOR_ELT(result, 1, ScalarReal(remaining));
+  SET_VECTOR_ELT(result, 2, ScalarLogical(timer->fd >= 0));
+  UNPROTECT(1);
+  return result;
+}
@@ -0,0 +1,257 @@
+
+#ifndef _WIN32
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "../processx.h"
+
+/* Feed a raw vector or a file to a connection, in a background thread.
+ *
+ * This is used for the standard input of a process, so the data is
+ * written while the main thread reads the output of the process.
+ * Files are copied with sendfile() on Linux, if possible, otherwise we
+ * read() them into a buffer. The thread owns the writeable file
+ * descriptor and closes it at the end of the data, so the child
+ * process sees the end of its input.
+ */
+
+#define PROCESSX_FEED_CHUNK (64 * 1024)
+
+typedef struct processx_feed_s {
+  int out;			/* writeable, owned by the thread */
+  int in;			/* input file, or -1 for a raw vector */
+  SEXP data;			/* raw vector, or R_NilValue */
+  const char *ptr;		/* data of the raw vector */
+  size_t size;
+  int stop[2];			/* self-pipe to stop the thread */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  double bytes;			/* bytes written so far */
+  int done;			/* whether the thread has finished */
+  int error;			/* errno, if the thread failed */
+} processx_feed_t;
+
+static void processx__feed_add(processx_feed_t *feed, size_t bytes) {
+  pthread_mutex_lock(&feed->lock);
+  feed->bytes += bytes;
+  pthread_mutex_unlock(&feed->lock);
+}
+
+static ssize_t processx__feed_write(processx_feed_t *feed, const char *buf,
+				    size_t len) {
+#ifdef MSG_NOSIGNAL
+  ssize_t ret = send(feed->out, buf, len, MSG_NOSIGNAL);
+  if (ret != -1 || errno != ENOTSOCK) return ret;
+#endif
+  /* SIGPIPE is blocked in this thread, so we get EPIPE */
+  return write(feed->out, buf, len);
+}
+
+static void *processx__feed_thread(void *arg) {
+  processx_feed_t *feed = arg;
+  struct pollfd fds[2];
+  const char *ptr = NULL;
+  char *buf = NULL;
+  size_t pos = 0, len = 0;
+  int err = 0;
+  sigset_t set;
+#ifdef __linux__
+  int use_sendfile = feed->in >= 0;
+#endif
+
+  /* Signals are for the main thread */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  if (feed->in < 0) {
+    ptr = feed->ptr;
+    len = feed->size;
+  }
+
+  fds[0].fd = feed->out;     fds[0].events = POLLOUT;
+  fds[1].fd = feed->stop[0]; fds[1].events = POLLIN;
+
+  while (1) {
+    ssize_t n;
+    int ret;
+
+#ifdef __linux__
+    if (!use_sendfile)
+#endif
+    {
+      /* Need more data from the file? */
+      if (pos == len && feed->in >= 0) {
+	if (!buf) buf = malloc(PROCESSX_FEED_CHUNK);
+	if (!buf) { err = ENOMEM; break; }
+	do {
+	  n = read(feed->in, buf, PROCESSX_FEED_CHUNK);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1) { err = errno; break; }
+	ptr = buf;
+	pos = 0;
+	len = n;
+      }
+      if (pos == len) break;
+    }
+
+    ret = poll(fds, 2, -1);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) { err = errno; break; }
+    if (fds[1].revents) break;
+
+#ifdef __linux__
+    if (use_sendfile) {
+      n = sendfile(feed->out, feed->in, NULL, PROCESSX_FEED_CHUNK);
+      if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+	use_sendfile = 0;
+	continue;
+      }
+      if (n == 0) break;
+    } else
+#endif
+    {
+      n = processx__feed_write(feed, ptr + pos, len - pos);
+      if (n > 0) pos += n;
+    }
+
+    if (n > 0) processx__feed_add(feed, n);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+    if (n == -1) { err = errno; break; }
+  }
+
+  if (buf) free(buf);
+  if (feed->in >= 0) close(feed->in);
+  feed->in = -1;
+  close(feed->out);
+  feed->out = -1;
+
+  pthread_mutex_lock(&feed->lock);
+  feed->done = 1;
+  feed->error = err;
+  pthread_mutex_unlock(&feed->lock);
+
+  return NULL;
+}
+
+static void processx__feed_finalizer(SEXP ptr) {
+  processx_feed_t *feed = R_ExternalPtrAddr(ptr);
+  if (!feed) return;
+  /* Stop the thread, if it is still running, and wait for it */
+  if (write(feed->stop[1], "x", 1) == -1) { /* cannot happen */ }
+  pthread_join(feed->thread, NULL);
+  pthread_mutex_destroy(&feed->lock);
+  close(feed->stop[0]);
+  close(feed->stop[1]);
+  if (feed->data != R_NilValue) R_ReleaseObject(feed->data);
+  free(feed);
+  R_ClearExternalPtr(ptr);
+}
+
+SEXP processx_connection_feed(SEXP con, SEXP data) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  processx_feed_t *feed;
+  SEXP result;
+  int ret;
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  if (ccon->handle < 0) {
+    R_THROW_ERROR("Invalid (uninitialized or closed?) connection object");
+  }
+
+  feed = calloc(1, sizeof(processx_feed_t));
+  if (!feed) R_THROW_ERROR("Cannot allocate memory for processx feed");
+  feed->out = feed->in = feed->stop[0] = feed->stop[1] = -1;
+  feed->data = R_NilValue;
+
+  if (TYPEOF(data) == STRSXP) {
+    const char *cfilename = CHAR(STRING_ELT(data, 0));
+    feed->in = open(cfilename, O_RDONLY);
+    if (feed->in == -1) {
+      free(feed);
+      R_THROW_SYSTEM_ERROR("Cannot open input file `%s`", cfilename);
+    }
+    processx__cloexec_fcntl(feed->in, 1);
+  }
+
+  if (pipe(feed->stop)) {
+    if (feed->in >= 0) close(feed->in);
+    free(feed);
+    R_THROW_SYSTEM_ERROR("Cannot create pipe for processx feed");
+  }
+  processx__cloexec_fcntl(feed->stop[0], 1);
+  processx__cloexec_fcntl(feed->stop[1], 1);
+
+  /* The thread gets its own copy of the file descriptor, and the
+     connection is closed, it cannot be written from R any more. */
+  feed->out = dup(ccon->handle);
+  if (feed->out == -1) {
+    if (feed->in >= 0) close(feed->in);
+    close(feed->stop[0]); close(feed->stop[1]);
+    free(feed);
+    R_THROW_SYSTEM_ERROR("Cannot duplicate connection for processx feed");
+  }
+  processx__cloexec_fcntl(feed->out, 1);
+  processx__nonblock_fcntl(feed->out, 1);
+  processx_c_connection_close(ccon);
+
+  /* We cannot call R from the thread, not even RAW() */
+  if (TYPEOF(data) == RAWSXP) {
+    R_PreserveObject(data);
+    feed->data = data;
+    feed->ptr = (const char*) RAW(data);
+    feed->size = XLENGTH(data);
+  }
+
+  pthread_mutex_init(&feed->lock, NULL);
+  ret = pthread_create(&feed->thread, NULL, processx__feed_thread, feed);
+  if (ret) {
+    if (feed->in >= 0) close(feed->in);
+    close(feed->out); close(feed->stop[0]); close(feed->stop[1]);
+    pthread_mutex_destroy(&feed->lock);
+    if (feed->data != R_NilValue) R_ReleaseObject(feed->data);
+    free(feed);
+    R_THROW_SYSTEM_ERROR_CODE(ret, "Cannot start processx feed thread");
+  }
+
+  result = PROTECT(R_MakeExternalPtr(feed, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(result, processx__feed_finalizer, 1);
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_feed_status(SEXP feed) {
+  processx_feed_t *cfeed = R_ExternalPtrAddr(feed);
+  const char *names[] = { "bytes", "done", "error", "" };
+  SEXP result;
+  double bytes;
+  int done, error;
+
+  if (!cfeed) R_THROW_ERROR("Invalid processx feed object");
+
+  pthread_mutex_lock(&cfeed->lock);
+  bytes = cfeed->bytes;
+  done = cfeed->done;
+  error = cfeed->error;
+  pthread_mutex_unlock(&cfeed->lock);
+
+  result = PROTECT(mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(result, 0, ScalarReal(bytes));
+  SET_VECTOR_ELT(result, 1, ScalarLogical(done));
+  SET_VECTOR_ELT(result, 2, error ? mkString(strerror(error)) :
+		 ScalarString(NA_STRING));
+  UNPROTECT(1);
+  return result;
+}
+
+#endif
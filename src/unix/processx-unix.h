@@ -70,6 +70,8 @@ void processx__create_control_write(processx_handle_t *handle,
 
 /* Interruptible system calls */
 
+int processx__poll(struct pollfd fds[], nfds_t nfds, int timeout);
+
 int processx__interruptible_poll(struct pollfd fds[],
 				 nfds_t nfds, int timeout);
 
@@ -52,6 +52,10 @@ extern char **environ;
 #include <sys/ioctl.h>
 #include <pthread.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 extern processx__child_list_t child_list_head;
 extern processx__child_list_t *child_list;
 extern processx__child_list_t child_free_list_head;
@@ -725,7 +729,7 @@ SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
 
   while (ctimeout < 0 || timeleft > PROCESSX_INTERRUPT_INTERVAL) {
     do {
-      ret = poll(&fd, 1, PROCESSX_INTERRUPT_INTERVAL);
+      ret = processx__poll(&fd, 1, PROCESSX_INTERRUPT_INTERVAL);
     } while (ret == -1 && errno == EINTR);
 
     /* If not a timeout, then we are done */
@@ -749,7 +753,7 @@ SEXP processx_wait(SEXP status, SEXP timeout, SEXP name) {
   /* Maybe we are not done, and there is a little left from the timeout */
   if (ret == 0 && timeleft >= 0) {
     do {
-      ret = poll(&fd, 1, timeleft);
+      ret = processx__poll(&fd, 1, timeleft);
     } while (ret == -1 && errno == EINTR);
   }
 
@@ -1033,6 +1037,68 @@ SEXP processx_get_pid(SEXP status) {
   return ScalarInteger(handle->pid);
 }
 
+/* On Linux the poll connection of a process can be a pidfd, instead of
+ * a pipe that the child inherits. The pidfd is readable once the process
+ * has exited, even if its children still hold the pipes. We can only use
+ * it if the kernel supports pidfd_open(), which we check once.
+ */
+
+static int processx__pidfd_open(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+SEXP processx__pidfd_supported(void) {
+  static int supported = -1;
+  if (supported == -1) {
+    int fd = processx__pidfd_open(getpid());
+    supported = fd >= 0;
+    if (fd >= 0) close(fd);
+  }
+  return ScalarLogical(supported);
+}
+
+SEXP processx__pidfd_connection(SEXP status, SEXP encoding) {
+  processx_handle_t *handle = R_ExternalPtrAddr(status);
+  const char *cencoding = CHAR(STRING_ELT(encoding, 0));
+  processx_file_type_t type = PROCESSX_FILE_TYPE_PIDFD;
+  int fd, err = 0;
+  SEXP result;
+
+  if (!handle) R_THROW_ERROR("Invalid processx handle");
+
+  /* The SIGCHLD handler must not reap the process in the meanwhile */
+  processx__block_sigchld();
+  if (handle->collected) {
+    /* Already reaped, we cannot open a pidfd any more. A pipe at EOF
+       behaves the same way. */
+    int pipefd[2];
+    type = PROCESSX_FILE_TYPE_ASYNCPIPE;
+    fd = pipe(pipefd) ? -1 : pipefd[0];
+    if (fd >= 0) {
+      close(pipefd[1]);
+      processx__cloexec_fcntl(fd, 1);
+      processx__nonblock_fcntl(fd, 1);
+    }
+  } else {
+    fd = processx__pidfd_open(handle->pid);
+  }
+  if (fd == -1) err = errno;
+  processx__unblock_sigchld();
+
+  if (fd == -1) {
+    R_THROW_SYSTEM_ERROR_CODE(err, "Cannot create poll connection for "
+                              "process %d", (int) handle->pid);
+  }
+
+  processx_c_connection_create(fd, type, cencoding, &result);
+  return result;
+}
+
 /* We send a 0 signal to check if the process is alive. Note that a process
  * that is in a zombie state also counts as 'alive' with this method.
 */
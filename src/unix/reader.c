@@ -0,0 +1,436 @@
+#ifndef _WIN32
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "../processx.h"
+
+/* Read connections in a background thread
+ *
+ * These connections are read by a single, shared I/O thread, so the
+ * child process can write its output even if R is busy. The thread
+ * owns the read side of the file descriptor, and puts the data into a
+ * queue of chunks. The queue has a single producer, the thread, and a
+ * single consumer, the main thread, so it needs no locks, only atomic
+ * loads and stores:
+ *
+ * - The producer only writes to the last chunk, and publishes the data
+ *   by updating `size`. When the chunk is full, it allocates a new one
+ *   and links it with `next`.
+ * - The consumer reads from the first chunk, up to `size`. It frees it
+ *   once it is full, all read, and `next` is set, i.e. the producer
+ *   has moved on.
+ *
+ * If more than `high_water` bytes are waiting, the thread stops reading
+ * the connection, until the main thread consumes some. The main thread
+ * can poll the `notify` pipe, which is readable when there is data in
+ * the queue, or the end of the stream was reached.
+ *
+ * The mutex only protects the list of connections, and it is only used
+ * when connections are added or removed.
+ */
+
+#define PROCESSX_READER_CHUNK (64 * 1024)
+#define PROCESSX_READER_ROUND (256 * 1024) /* read per connection and poll */
+
+typedef struct processx_reader_chunk_s {
+  struct processx_reader_chunk_s *next;
+  size_t size;			/* bytes written by the producer */
+  size_t start;			/* bytes read by the consumer */
+  char data[PROCESSX_READER_CHUNK];
+} processx_reader_chunk_t;
+
+struct processx_reader_s {
+  int fd;
+  int notify[2];		/* readable if there is data */
+  size_t high_water;
+  processx_reader_chunk_t *head;	/* consumer */
+  processx_reader_chunk_t *tail;	/* producer */
+  size_t bytes;			/* bytes in the queue */
+  int signaled;			/* there is a byte in `notify` */
+  int paused;			/* reached the high water mark */
+  int eof;			/* end of stream, or error */
+  int error;			/* errno */
+  int stopping, stopped;	/* protected by the mutex */
+};
+
+static pthread_mutex_t processx__reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t processx__reader_cond = PTHREAD_COND_INITIALIZER;
+static processx_reader_t **processx__readers = NULL;
+static size_t processx__nreaders = 0, processx__readers_size = 0;
+static int processx__reader_running = 0;
+static int processx__reader_wake[2] = { -1, -1 };
+
+#define PROCESSX__LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define PROCESSX__STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+static void processx__reader_wakeup(void) {
+  if (write(processx__reader_wake[1], "x", 1) == -1) {
+    /* The pipe is full, so the thread will wake up anyway */
+  }
+}
+
+static void processx__reader_clear(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0) ;
+}
+
+/* Producer side, in the I/O thread */
+
+static void processx__reader_notify(processx_reader_t *reader) {
+  if (!__atomic_exchange_n(&reader->signaled, 1, __ATOMIC_SEQ_CST)) {
+    if (write(reader->notify[1], "x", 1) == -1) { /* cannot happen */ }
+  }
+}
+
+static void processx__reader_fill(processx_reader_t *reader) {
+  size_t round = 0;
+
+  while (round < PROCESSX_READER_ROUND) {
+    processx_reader_chunk_t *tail = reader->tail;
+    ssize_t n;
+
+    if (PROCESSX__LOAD(reader->bytes) >= reader->high_water) {
+      /* Check again after pausing, the consumer might have been
+	 reading in the meanwhile, see processx__reader_read() */
+      PROCESSX__STORE(reader->paused, 1);
+      if (PROCESSX__LOAD(reader->bytes) >= reader->high_water) break;
+      PROCESSX__STORE(reader->paused, 0);
+    }
+
+    if (tail->size == PROCESSX_READER_CHUNK) {
+      processx_reader_chunk_t *chunk =
+	malloc(sizeof(processx_reader_chunk_t));
+      if (!chunk) {
+	reader->error = ENOMEM;
+	PROCESSX__STORE(reader->eof, 1);
+	break;
+      }
+      chunk->next = NULL;
+      chunk->size = chunk->start = 0;
+      reader->tail = chunk;
+      PROCESSX__STORE(tail->next, chunk);
+      tail = chunk;
+    }
+
+    n = read(reader->fd, tail->data + tail->size,
+	     PROCESSX_READER_CHUNK - tail->size);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EAGAIN) break;
+    if (n <= 0) {
+      if (n == -1) reader->error = errno;
+      PROCESSX__STORE(reader->eof, 1);
+      break;
+    }
+
+    PROCESSX__STORE(tail->size, tail->size + n);
+    __atomic_add_fetch(&reader->bytes, n, __ATOMIC_SEQ_CST);
+    round += n;
+  }
+
+  processx__reader_notify(reader);
+}
+
+static void *processx__reader_thread(void *arg) {
+  struct pollfd *fds = NULL;
+  processx_reader_t **polled = NULL;
+  size_t fds_size = 0;
+  sigset_t set;
+
+  /* Signals are for the main thread */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&processx__reader_lock);
+
+  while (1) {
+    size_t i, j, nfds = 1;
+    int ret;
+
+    /* Let go of the stopped connections */
+    for (i = 0, j = 0; i < processx__nreaders; i++) {
+      processx_reader_t *reader = processx__readers[i];
+      if (reader->stopping) {
+	reader->stopped = 1;
+      } else {
+	processx__readers[j++] = reader;
+      }
+    }
+    if (j < processx__nreaders) {
+      processx__nreaders = j;
+      pthread_cond_broadcast(&processx__reader_cond);
+    }
+
+    if (processx__nreaders == 0) break;
+
+    if (fds_size < processx__nreaders + 1) {
+      size_t newsize = (processx__nreaders + 1) * 2;
+      struct pollfd *newfds = realloc(fds, newsize * sizeof(struct pollfd));
+      processx_reader_t **newpolled =
+	realloc(polled, newsize * sizeof(processx_reader_t*));
+      if (newfds) fds = newfds;
+      if (newpolled) polled = newpolled;
+      if (!newfds || !newpolled) {
+	/* Try again later */
+	pthread_mutex_unlock(&processx__reader_lock);
+	usleep(10000);
+	pthread_mutex_lock(&processx__reader_lock);
+	continue;
+      }
+      fds_size = newsize;
+    }
+
+    fds[0].fd = processx__reader_wake[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for (i = 0; i < processx__nreaders; i++) {
+      processx_reader_t *reader = processx__readers[i];
+      if (PROCESSX__LOAD(reader->eof) || PROCESSX__LOAD(reader->paused)) {
+	continue;
+      }
+      fds[nfds].fd = reader->fd;
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      polled[nfds++] = reader;
+    }
+
+    /* Connections are only freed after they are stopped, and that
+       needs the lock, so we can use them without it. */
+    pthread_mutex_unlock(&processx__reader_lock);
+
+    ret = poll(fds, nfds, -1);
+    if (ret > 0) {
+      if (fds[0].revents) processx__reader_clear(processx__reader_wake[0]);
+      for (i = 1; i < nfds; i++) {
+	if (fds[i].revents) processx__reader_fill(polled[i]);
+      }
+    }
+
+    pthread_mutex_lock(&processx__reader_lock);
+  }
+
+  processx__reader_running = 0;
+  pthread_mutex_unlock(&processx__reader_lock);
+
+  free(fds);
+  free(polled);
+  return NULL;
+}
+
+/* Consumer side, in the main thread */
+
+/* Like read(): returns the number of bytes, 0 at the end of the
+   stream, and -1 with EAGAIN if there is no data yet. */
+
+ssize_t processx__reader_read(processx_connection_t *ccon, char *buf,
+			     size_t size) {
+  processx_reader_t *reader = ccon->reader;
+  int eof = PROCESSX__LOAD(reader->eof);
+  size_t done = 0;
+
+  while (done < size) {
+    processx_reader_chunk_t *head = reader->head;
+    size_t avail = PROCESSX__LOAD(head->size) - head->start;
+    if (avail > 0) {
+      size_t n = avail < size - done ? avail : size - done;
+      memcpy(buf + done, head->data + head->start, n);
+      head->start += n;
+      done += n;
+    } else if (head->start == PROCESSX_READER_CHUNK &&
+	       PROCESSX__LOAD(head->next)) {
+      reader->head = head->next;
+      free(head);
+    } else {
+      break;
+    }
+  }
+
+  if (done > 0) {
+    __atomic_sub_fetch(&reader->bytes, done, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&reader->paused, 0, __ATOMIC_SEQ_CST)) {
+      processx__reader_wakeup();
+    }
+    return done;
+  }
+
+  /* The data is published before `eof`, so if `eof` was set already
+     at the start, then the queue is really empty. */
+  if (eof) {
+    if (reader->error) {
+      errno = reader->error;
+      return -1;
+    }
+    return 0;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+/* Whether there is something to read. If not, `notify` is cleared, so
+   it can be polled. */
+
+int processx__reader_pending(processx_connection_t *ccon) {
+  processx_reader_t *reader = ccon->reader;
+  if (PROCESSX__LOAD(reader->bytes) > 0 || PROCESSX__LOAD(reader->eof)) {
+    return 1;
+  }
+  PROCESSX__STORE(reader->signaled, 0);
+  processx__reader_clear(reader->notify[0]);
+  return PROCESSX__LOAD(reader->bytes) > 0 || PROCESSX__LOAD(reader->eof);
+}
+
+int processx__reader_fd(processx_connection_t *ccon) {
+  return ccon->reader->notify[0];
+}
+
+double processx__reader_bytes(processx_connection_t *ccon) {
+  return (double) PROCESSX__LOAD(ccon->reader->bytes);
+}
+
+/* Called before the connection is closed or destroyed. Waits until
+   the thread has let go of the connection. Data that was not read yet
+   is dropped. */
+
+void processx__reader_stop(processx_connection_t *ccon) {
+  processx_reader_t *reader = ccon->reader;
+  processx_reader_chunk_t *chunk;
+
+  pthread_mutex_lock(&processx__reader_lock);
+  reader->stopping = 1;
+  processx__reader_wakeup();
+  while (!reader->stopped) {
+    pthread_cond_wait(&processx__reader_cond, &processx__reader_lock);
+  }
+  pthread_mutex_unlock(&processx__reader_lock);
+
+  chunk = reader->head;
+  while (chunk) {
+    processx_reader_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  close(reader->notify[0]);
+  close(reader->notify[1]);
+  free(reader);
+  ccon->reader = NULL;
+}
+
+SEXP processx_connection_start_reader(SEXP con, SEXP high_water) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  double chigh_water = REAL(high_water)[0];
+  processx_reader_t *reader;
+  int ret = 0;
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  if (ccon->is_closed_ || ccon->handle < 0) {
+    R_THROW_ERROR("Invalid (uninitialized or closed?) connection object");
+  }
+  if (ccon->reader) return R_NilValue;
+  if (ccon->poller_item) {
+    R_THROW_ERROR("Cannot read a connection in the background, it is "
+		  "in a poller");
+  }
+
+  reader = calloc(1, sizeof(processx_reader_t));
+  if (!reader) R_THROW_ERROR("Cannot allocate memory for processx reader");
+  reader->head = reader->tail = malloc(sizeof(processx_reader_chunk_t));
+  if (!reader->head) {
+    free(reader);
+    R_THROW_ERROR("Cannot allocate memory for processx reader");
+  }
+  reader->head->next = NULL;
+  reader->head->size = reader->head->start = 0;
+  reader->fd = ccon->handle;
+  reader->high_water = chigh_water < 1 ? 1 : (size_t) chigh_water;
+
+  if (pipe(reader->notify)) {
+    free(reader->head);
+    free(reader);
+    R_THROW_SYSTEM_ERROR("Cannot create pipe for processx reader");
+  }
+  processx__cloexec_fcntl(reader->notify[0], 1);
+  processx__cloexec_fcntl(reader->notify[1], 1);
+  processx__nonblock_fcntl(reader->notify[0], 1);
+  processx__nonblock_fcntl(reader->notify[1], 1);
+
+  /* The thread polls the fd, it must not block in read() */
+  processx__nonblock_fcntl(ccon->handle, 1);
+
+  pthread_mutex_lock(&processx__reader_lock);
+
+  if (processx__reader_wake[0] == -1) {
+    if (pipe(processx__reader_wake)) {
+      ret = errno;
+    } else {
+      processx__cloexec_fcntl(processx__reader_wake[0], 1);
+      processx__cloexec_fcntl(processx__reader_wake[1], 1);
+      processx__nonblock_fcntl(processx__reader_wake[0], 1);
+      processx__nonblock_fcntl(processx__reader_wake[1], 1);
+    }
+  }
+
+  if (!ret && processx__nreaders == processx__readers_size) {
+    size_t newsize = processx__readers_size ? processx__readers_size * 2 : 16;
+    processx_reader_t **newreaders =
+      realloc(processx__readers, newsize * sizeof(processx_reader_t*));
+    if (newreaders) {
+      processx__readers = newreaders;
+      processx__readers_size = newsize;
+    } else {
+      ret = ENOMEM;
+    }
+  }
+
+  if (!ret && !processx__reader_running) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, processx__reader_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (!ret) processx__reader_running = 1;
+  }
+
+  if (!ret) {
+    processx__readers[processx__nreaders++] = reader;
+    ccon->reader = reader;
+    processx__reader_wakeup();
+  }
+
+  pthread_mutex_unlock(&processx__reader_lock);
+
+  if (ret) {
+    close(reader->notify[0]);
+    close(reader->notify[1]);
+    free(reader->head);
+    free(reader);
+    R_THROW_SYSTEM_ERROR_CODE(ret, "Cannot start processx reader thread");
+  }
+
+  return R_NilValue;
+}
+
+SEXP processx_reader_status(SEXP con) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  const char *names[] = { "bytes", "paused", "eof", "" };
+  processx_reader_t *reader;
+  SEXP result;
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  reader = ccon->reader;
+
+  result = PROTECT(mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(result, 0,
+		 ScalarReal(reader ? processx__reader_bytes(ccon) : 0));
+  SET_VECTOR_ELT(result, 1,
+		 ScalarLogical(reader && PROCESSX__LOAD(reader->paused)));
+  SET_VECTOR_ELT(result, 2,
+		 ScalarLogical(reader && PROCESSX__LOAD(reader->eof)));
+  UNPROTECT(1);
+  return result;
+}
+
+#endif
@@ -0,0 +1,302 @@
+
+#ifndef _WIN32
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "../processx.h"
+
+/* Copy the output of a connection to a file, in a background thread.
+ *
+ * On Linux we use splice(), through an intermediate pipe, so the data
+ * does not have to be copied to user space at all. Elsewhere, or if
+ * splice() is not supported for the file descriptors, we fall back to
+ * read() and write(). The thread owns the readable file descriptor,
+ * the connection itself is closed when the tee is started.
+ *
+ * The main thread can query the number of bytes written so far, and
+ * whether the thread is done. The tail of the output can be read from
+ * the file itself, so no data needs to be kept in memory.
+ */
+
+#define PROCESSX_TEE_CHUNK (64 * 1024)
+
+typedef struct processx_tee_s {
+  int in;			/* readable, owned by the thread */
+  int out;			/* output file */
+  int stop[2];			/* self-pipe to stop the thread */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  double bytes;			/* bytes written so far */
+  int done;			/* whether the thread has finished */
+  int error;			/* errno, if the thread failed */
+} processx_tee_t;
+
+static void processx__tee_add(processx_tee_t *tee, size_t bytes) {
+  pthread_mutex_lock(&tee->lock);
+  tee->bytes += bytes;
+  pthread_mutex_unlock(&tee->lock);
+}
+
+static int processx__tee_write_all(processx_tee_t *tee, const char *buf,
+				   size_t len) {
+  while (len > 0) {
+    ssize_t m = write(tee->out, buf, len);
+    if (m == -1 && errno == EINTR) continue;
+    if (m == -1) return -1;
+    processx__tee_add(tee, m);
+    buf += m;
+    len -= m;
+  }
+  return 0;
+}
+
+#ifdef __linux__
+
+/* Move `len` bytes from the intermediate pipe to the output file. If
+   the file does not support splice(), then we copy them. */
+
+static int processx__tee_splice_out(processx_tee_t *tee, int from,
+				    size_t len, char **buf) {
+  while (len > 0) {
+    ssize_t m = splice(from, NULL, tee->out, NULL, len, SPLICE_F_MOVE);
+    if (m == -1 && errno == EINTR) continue;
+    if (m == -1 && errno == EINVAL) {
+      if (!*buf) *buf = malloc(PROCESSX_TEE_CHUNK);
+      if (!*buf) return -1;
+      m = read(from, *buf, len < PROCESSX_TEE_CHUNK ? len : PROCESSX_TEE_CHUNK);
+      if (m <= 0) return -1;
+      if (processx__tee_write_all(tee, *buf, m)) return -1;
+    } else if (m <= 0) {
+      return -1;
+    } else {
+      processx__tee_add(tee, m);
+    }
+    len -= m;
+  }
+  return 0;
+}
+
+#endif
+
+static void *processx__tee_thread(void *arg) {
+  processx_tee_t *tee = arg;
+  struct pollfd fds[2];
+  char *buf = NULL;
+  int err = 0;
+  sigset_t set;
+#ifdef __linux__
+  int pp[2] = { -1, -1 };
+  int use_splice = pipe(pp) == 0;
+#endif
+
+  /* Signals are for the main thread */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  fds[0].fd = tee->in;      fds[0].events = POLLIN;
+  fds[1].fd = tee->stop[0]; fds[1].events = POLLIN;
+
+  while (1) {
+    ssize_t n;
+    int ret = poll(fds, 2, -1);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) { err = errno; break; }
+    if (fds[1].revents) break;
+
+#ifdef __linux__
+    if (use_splice) {
+      n = splice(tee->in, NULL, pp[1], NULL, PROCESSX_TEE_CHUNK,
+		 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == -1 && errno == EINVAL) {
+	use_splice = 0;
+	continue;
+      }
+      if (n > 0 && processx__tee_splice_out(tee, pp[0], n, &buf)) {
+	err = errno ? errno : EIO;
+	break;
+      }
+    } else
+#endif
+    {
+      if (!buf) buf = malloc(PROCESSX_TEE_CHUNK);
+      if (!buf) { err = ENOMEM; break; }
+      n = read(tee->in, buf, PROCESSX_TEE_CHUNK);
+      if (n > 0 && processx__tee_write_all(tee, buf, n)) {
+	err = errno;
+	break;
+      }
+    }
+
+    if (n == 0) break;
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+    if (n == -1) { err = errno; break; }
+  }
+
+#ifdef __linux__
+  if (pp[0] >= 0) close(pp[0]);
+  if (pp[1] >= 0) close(pp[1]);
+#endif
+  if (buf) free(buf);
+  close(tee->in);
+  tee->in = -1;
+
+  pthread_mutex_lock(&tee->lock);
+  tee->done = 1;
+  tee->error = err;
+  pthread_mutex_unlock(&tee->lock);
+
+  return NULL;
+}
+
+static void processx__tee_finalizer(SEXP ptr) {
+  processx_tee_t *tee = R_ExternalPtrAddr(ptr);
+  if (!tee) return;
+  /* Stop the thread, if it is still running, and wait for it */
+  if (write(tee->stop[1], "x", 1) == -1) { /* cannot happen */ }
+  pthread_join(tee->thread, NULL);
+  pthread_mutex_destroy(&tee->lock);
+  close(tee->out);
+  close(tee->stop[0]);
+  close(tee->stop[1]);
+  free(tee);
+  R_ClearExternalPtr(ptr);
+}
+
+SEXP processx_connection_tee(SEXP con, SEXP filename) {
+  processx_connection_t *ccon = R_ExternalPtrAddr(con);
+  const char *cfilename = CHAR(STRING_ELT(filename, 0));
+  processx_tee_t *tee;
+  SEXP result;
+  int ret;
+
+  if (!ccon) R_THROW_ERROR("Invalid connection object");
+  if (ccon->handle < 0) {
+    R_THROW_ERROR("Invalid (uninitialized or closed?) connection object");
+  }
+
+  tee = calloc(1, sizeof(processx_tee_t));
+  if (!tee) R_THROW_ERROR("Cannot allocate memory for processx tee");
+  tee->in = tee->out = tee->stop[0] = tee->stop[1] = -1;
+
+  tee->out = open(cfilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (tee->out == -1) {
+    free(tee);
+    R_THROW_SYSTEM_ERROR("Cannot open tee output file `%s`", cfilename);
+  }
+  processx__cloexec_fcntl(tee->out, 1);
+
+  /* Whatever is buffered in the connection goes first */
+  if ((!ccon->binary && ccon->utf8_data_size > 0 &&
+       processx__tee_write_all(tee, ccon->utf8, ccon->utf8_data_size)) ||
+      (ccon->buffer_data_size > 0 &&
+       processx__tee_write_all(tee, ccon->buffer, ccon->buffer_data_size))) {
+    close(tee->out);
+    free(tee);
+    R_THROW_SYSTEM_ERROR("Cannot write tee output file `%s`", cfilename);
+  }
+  ccon->utf8_data_size = ccon->buffer_data_size = 0;
+
+  if (pipe(tee->stop)) {
+    close(tee->out);
+    free(tee);
+    R_THROW_SYSTEM_ERROR("Cannot create pipe for processx tee");
+  }
+  processx__cloexec_fcntl(tee->stop[0], 1);
+  processx__cloexec_fcntl(tee->stop[1], 1);
+
+  /* The thread gets its own copy of the file descriptor, and the
+     connection is closed, it cannot be read from R any more. */
+  tee->in = dup(ccon->handle);
+  if (tee->in == -1) {
+    close(tee->out); close(tee->stop[0]); close(tee->stop[1]);
+    free(tee);
+    R_THROW_SYSTEM_ERROR("Cannot duplicate connection for processx tee");
+  }
+  processx__cloexec_fcntl(tee->in, 1);
+  processx__nonblock_fcntl(tee->in, 1);
+  processx_c_connection_close(ccon);
+
+  pthread_mutex_init(&tee->lock, NULL);
+  ret = pthread_create(&tee->thread, NULL, processx__tee_thread, tee);
+  if (ret) {
+    close(tee->in); close(tee->out); close(tee->stop[0]); close(tee->stop[1]);
+    pthread_mutex_destroy(&tee->lock);
+    free(tee);
+    R_THROW_SYSTEM_ERROR_CODE(ret, "Cannot start processx tee thread");
+  }
+
+  result = PROTECT(R_MakeExternalPtr(tee, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(result, processx__tee_finalizer, 1);
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_tee_status(SEXP tee) {
+  processx_tee_t *ctee = R_ExternalPtrAddr(tee);
+  const char *names[] = { "bytes", "done", "error", "" };
+  SEXP result;
+  double bytes;
+  int done, error;
+
+  if (!ctee) R_THROW_ERROR("Invalid processx tee object");
+
+  pthread_mutex_lock(&ctee->lock);
+  bytes = ctee->bytes;
+  done = ctee->done;
+  error = ctee->error;
+  pthread_mutex_unlock(&ctee->lock);
+
+  result = PROTECT(mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(result, 0, ScalarReal(bytes));
+  SET_VECTOR_ELT(result, 1, ScalarLogical(done));
+  SET_VECTOR_ELT(result, 2, error ? mkString(strerror(error)) :
+		 ScalarString(NA_STRING));
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP processx_tee_wait(SEXP tee, SEXP timeout) {
+  processx_tee_t *ctee = R_ExternalPtrAddr(tee);
+  int ctimeout = INTEGER(timeout)[0];
+  int done;
+
+  if (!ctee) R_THROW_ERROR("Invalid processx tee object");
+
+  /* The thread does not notify us, so we check every 10ms, and we
+     also check for interrupts, every now and then. */
+  while (1) {
+    int waited = 0;
+    pthread_mutex_lock(&ctee->lock);
+    done = ctee->done;
+    pthread_mutex_unlock(&ctee->lock);
+    if (done || ctimeout == 0) break;
+
+    while (waited < PROCESSX_INTERRUPT_INTERVAL &&
+	   (ctimeout < 0 || waited < ctimeout)) {
+      struct timespec ts = { 0, 10 * 1000 * 1000 };
+      nanosleep(&ts, NULL);
+      waited += 10;
+      pthread_mutex_lock(&ctee->lock);
+      done = ctee->done;
+      pthread_mutex_unlock(&ctee->lock);
+      if (done) break;
+    }
+    if (done) break;
+    if (ctimeout > 0) {
+      ctimeout -= waited;
+      if (ctimeout <= 0) break;
+    }
+    R_CheckUserInterrupt();
+  }
+
+  return ScalarLogical(done);
+}
+
+#endif
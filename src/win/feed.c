@@ -0,0 +1,22 @@
+
+#ifdef _WIN32
+
+#include <Rdefines.h>
+
+#include "../errors.h"
+
+/* On Windows `stdin_data` is written to a file first, and the process
+   reads that, so we don't need a feeder thread. We still need the C
+   interfaces, but they simply give errors. */
+
+SEXP processx_connection_feed(SEXP con, SEXP data) {
+  R_THROW_ERROR("Feeding connections is not supported on Windows");
+  return R_NilValue;
+}
+
+SEXP processx_feed_status(SEXP feed) {
+  R_THROW_ERROR("Feeding connections is not supported on Windows");
+  return R_NilValue;
+}
+
+#endif
@@ -1248,6 +1248,17 @@ SEXP processx_get_pid(SEXP status) {
   return ScalarInteger(handle->dwProcessId);
 }
 
+/* No pidfds on Windows, the poll connection is always a pipe */
+
+SEXP processx__pidfd_supported(void) {
+  return ScalarLogical(0);
+}
+
+SEXP processx__pidfd_connection(SEXP status, SEXP encoding) {
+  R_THROW_ERROR("pidfd poll connections are not supported on Windows");
+  return R_NilValue;
+}
+
 SEXP processx__process_exists(SEXP pid) {
   DWORD cpid = INTEGER(pid)[0];
   HANDLE proc = OpenProcess(PROCESS_QUERY_INFORMATION, FALSE, cpid);
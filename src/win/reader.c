@@ -0,0 +1,19 @@
+#ifdef _WIN32
+
+#include <Rdefines.h>
+
+#include "../errors.h"
+
+/* Background readers are not implemented on Windows yet, we still
+   need the C interfaces, but they simply give errors. */
+
+SEXP processx_connection_start_reader(SEXP con, SEXP high_water) {
+  R_THROW_ERROR("Background readers are not supported on Windows");
+  return R_NilValue;
+}
+
+SEXP processx_reader_status(SEXP con) {
+  R_THROW_ERROR("Background readers are not supported on Windows");
+  return R_NilValue;
+}
+#endif
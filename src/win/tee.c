@@ -0,0 +1,26 @@
+
+#ifdef _WIN32
+
+#include <Rdefines.h>
+
+#include "../errors.h"
+
+/* Teeing connections to files is not implemented on Windows yet, we
+   still need the C interfaces, but they simply give errors. */
+
+SEXP processx_connection_tee(SEXP con, SEXP filename) {
+  R_THROW_ERROR("Teeing connections is not supported on Windows");
+  return R_NilValue;
+}
+
+SEXP processx_tee_status(SEXP tee) {
+  R_THROW_ERROR("Teeing connections is not supported on Windows");
+  return R_NilValue;
+}
+
+SEXP processx_tee_wait(SEXP tee, SEXP timeout) {
+  R_THROW_ERROR("Teeing connections is not supported on Windows");
+  return R_NilValue;
+}
+
+#endif